@@ -0,0 +1,192 @@
+/*
+ * Clipboard content exchanged with X clients.
+ *
+ * Content too large for one property is transferred with the ICCCM INCR
+ * mechanism, one SELECTION_CHUNK_SIZE property at a time. dom0 still gets
+ * the content in a single MSG_CLIPBOARD_DATA, truncated to
+ * MAX_CLIPBOARD_SIZE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "guiclient.h"
+#include "gui_common.h"
+#include "qubes-gui-protocol.h"
+#include "common.h"
+#include "clipboard.h"
+
+/* X clients get selections larger than this incrementally */
+#define SELECTION_CHUNK_SIZE	(64 * 1024)
+/* largest selection received from or sent to an X client */
+#define MAX_SELECTION_SIZE	(64 * 1024 * 1024)
+
+
+static void reset_stream(struct clipboard_stream *s)
+{
+	free(s->data);
+	memset(s, 0, sizeof(*s));
+}
+
+/* make room for len more bytes, and a terminating NUL
+ * return -1 if the content would be larger than MAX_SELECTION_SIZE */
+static int grow_stream(struct clipboard_stream *s, size_t len)
+{
+	unsigned char *p;
+	size_t size;
+
+	if (len > MAX_SELECTION_SIZE - s->len)
+		return -1;
+	if (s->len + len < s->size)
+		return 0;
+
+	size = s->size ? s->size : 4096;
+	while (size <= s->len + len)
+		size *= 2;
+	p = realloc(s->data, size);
+	if (!p) {
+		perror("realloc");
+		exit(1);
+	}
+	s->data = p;
+	s->size = size;
+	return 0;
+}
+
+/* make data, a NUL-terminated buffer of len bytes, the content of the
+ * selections owned by the agent */
+void set_clipboard(Ghandles * g, unsigned char *data, size_t len)
+{
+	Atom Clp = XInternAtom(g->display, "CLIPBOARD", False);
+
+	free(g->clipboard_data);
+	g->clipboard_data = data;
+	g->clipboard_data_len = len;
+	XSetSelectionOwner(g->display, XA_PRIMARY, g->stub_win,
+			   CurrentTime);
+	XSetSelectionOwner(g->display, Clp, g->stub_win, CurrentTime);
+#ifndef CLIPBOARD_4WAY
+	XSync(g->display, False);
+	feed_xdriver(g, 'B', 2, 1);
+	feed_xdriver(g, 'B', 2, 0);
+#endif
+}
+
+static void send_incr_chunk(Ghandles * g)
+{
+	struct clipboard_stream *s = &g->incr_send;
+	size_t len;
+
+	len = min(s->len - s->off, SELECTION_CHUNK_SIZE);
+	XChangeProperty(g->display, s->window, s->property, s->type, 8,
+			PropModeReplace, s->data + s->off, len);
+	s->off += len;
+	/* the empty chunk ends the transfer */
+	if (len == 0)
+		reset_stream(s);
+}
+
+/* answer a selection request with the converted content ct incrementally,
+ * if it doesn't fit in one property: the requestor deletes the property to
+ * get each chunk
+ * return false if ct is small enough to be set at once */
+bool start_incr_send(Ghandles * g, const XSelectionRequestEvent * req,
+		     const XTextProperty * ct)
+{
+	struct clipboard_stream *s = &g->incr_send;
+	XWindowAttributes attr;
+	long size;
+
+	if (ct->format != 8 || ct->nitems <= SELECTION_CHUNK_SIZE)
+		return false;
+
+	/* a transfer to an other requestor is abandoned */
+	reset_stream(s);
+	if (grow_stream(s, ct->nitems) != 0)
+		return false;
+	memcpy(s->data, ct->value, ct->nitems);
+	s->len = ct->nitems;
+	s->window = req->requestor;
+	s->property = req->property;
+	s->type = ct->encoding;
+	s->active = 1;
+
+	if (XGetWindowAttributes(g->display, req->requestor, &attr))
+		XSelectInput(g->display, req->requestor,
+			     attr.your_event_mask | PropertyChangeMask);
+	size = s->len;
+	XChangeProperty(g->display, req->requestor, req->property,
+			XInternAtom(g->display, "INCR", False), 32,
+			PropModeReplace, (unsigned char *)&size, 1);
+	return true;
+}
+
+/* the owner of a selection started to send it incrementally to property of
+ * window: deleting it asks for the first chunk */
+void start_incr_recv(Ghandles * g, Window window, Atom property)
+{
+	struct clipboard_stream *s = &g->incr_recv;
+
+	reset_stream(s);
+	s->window = window;
+	s->property = property;
+	s->active = 1;
+	XDeleteProperty(g->display, window, property);
+}
+
+static void recv_incr_chunk(Ghandles * g)
+{
+	struct clipboard_stream *s = &g->incr_recv;
+	unsigned long nitems, bytes_left;
+	unsigned char *data;
+	int format, ret;
+	Atom type;
+
+	ret = XGetWindowProperty(g->display, s->window, s->property, 0,
+				 MAX_SELECTION_SIZE / 4, True,
+				 AnyPropertyType, &type, &format, &nitems,
+				 &bytes_left, &data);
+	if (ret != Success) {
+		reset_stream(s);
+		return;
+	}
+
+	if (nitems == 0) {
+		/* the empty chunk ends the transfer */
+		send_clipboard_data(g, (char *)s->data, s->len);
+		reset_stream(s);
+	} else if (format != 8 || grow_stream(s, nitems) != 0) {
+		fprintf(stderr, "selection too large or not text, dropped\n");
+		reset_stream(s);
+	} else {
+		memcpy(s->data + s->len, data, nitems);
+		s->len += nitems;
+	}
+	XFree(data);
+}
+
+/* handle PropertyNotify events of INCR transfers
+ * return true if the event belongs to one */
+bool process_clipboard_property(Ghandles * g, const XPropertyEvent * ev)
+{
+	struct clipboard_stream *s;
+
+	s = &g->incr_send;
+	if (s->active && ev->window == s->window && ev->atom == s->property) {
+		if (ev->state == PropertyDelete)
+			send_incr_chunk(g);
+		return true;
+	}
+
+	s = &g->incr_recv;
+	if (s->active && ev->window == s->window && ev->atom == s->property) {
+		if (ev->state == PropertyNewValue)
+			recv_incr_chunk(g);
+		return true;
+	}
+
+	return false;
+}
+
+// vim: noet:ts=8:
@@ -0,0 +1,12 @@
+#ifndef _CLIPBOARD_H
+#define _CLIPBOARD_H 1
+
+void set_clipboard(Ghandles * g, unsigned char *data, size_t len);
+bool start_incr_send(Ghandles * g, const XSelectionRequestEvent * req,
+		     const XTextProperty * ct);
+void start_incr_recv(Ghandles * g, Window window, Atom property);
+bool process_clipboard_property(Ghandles * g, const XPropertyEvent * ev);
+
+#endif /* _CLIPBOARD_H */
+
+// vim: noet:ts=8:
@@ -40,8 +40,9 @@ void send_clipboard_data(Ghandles * g, char *data, int len)
 	else
 		hdr.window = len;
 	hdr.untrusted_len = hdr.window;
-	write_struct(g->xchan, hdr);
-	write_data(g->xchan, (char *) data, len);
+	/* don't send more than announced in the header */
+	real_write_message(g->xchan, (char *)&hdr, sizeof(hdr), data,
+			   hdr.window);
 }
 
 uint32_t flags_from_atom(Ghandles * g, Atom a) {
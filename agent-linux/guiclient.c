@@ -28,7 +28,6 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/un.h>
-#include <sys/poll.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <arpa/inet.h>
@@ -56,6 +55,7 @@
 #include "guiclient.h"
 #include "gui_common.h"
 #include "list.h"
+#include "tiles.h"
 
 #include "cuapi/guest/xchan.h"
 #include "xchan.h"
@@ -172,42 +172,117 @@ static void reconnect(Ghandles *g)
 		usleep(100000);
 }
 
-static void proxy(Ghandles *g)
+/* return true if pending damage has waited longer than the flush budget */
+static bool damage_flush_due(Ghandles *g)
+{
+	struct timespec now;
+	long elapsed_ms;
+
+	if (!g->damage_pending)
+		return false;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed_ms = (now.tv_sec - g->damage_since.tv_sec) * 1000 +
+		(now.tv_nsec - g->damage_since.tv_nsec) / 1000000;
+
+	return elapsed_ms >= DAMAGE_FLUSH_BUDGET_MS;
+}
+
+/* discard eventfd notification */
+static int xchan_notified(struct event_source *src)
 {
-	struct pollfd pollfds[2];
+	struct xchan *xchan = src->arg;
 	err_t error;
-	int busy;
 
-	pollfds[0].fd = g->xchan->event_fd;
-	pollfds[0].events = POLLIN;
+	error = xchan_poll(xchan);
+	if (error) {
+		print_error(error, "xchan poll failed");
+		return -1;
+	}
+	return 0;
+}
 
-	pollfds[1].fd = ConnectionNumber(g->display);
-	pollfds[1].events = POLLIN | POLLERR;
+static unsigned int run_messages(void *arg, unsigned int max)
+{
+	return handle_messages(arg, max);
+}
 
-	while (1) {
-		if (TEMP_FAILURE_RETRY(poll(pollfds, 2, -1)) == -1)
-			err(1, "poll");
-
-		/* discard eventfd notification */
-		if (pollfds[0].revents & POLLIN) {
-			error = xchan_poll(g->xchan);
-			if (error) {
-				print_error(error, "xchan poll failed");
-				break;
-			}
-		}
+static unsigned int run_xevents(void *arg, unsigned int max)
+{
+	Ghandles *g = arg;
+	unsigned int n;
+
+	for (n = 0; n < max && XEventsQueued(g->display, QueuedAfterReading);
+	     n++) {
+		process_xevent(g);
+		if (damage_flush_due(g))
+			flush_damage(g);
+	}
+	return n;
+}
 
-		do {
-			busy = 0;
-			if (XPending(g->display)) {
-				process_xevent(g);
-				busy = 1;
-			}
+static unsigned int xevents_depth(void *arg)
+{
+	Ghandles *g = arg;
 
-			if (handle_message(g))
-				busy = 1;
+	return XEventsQueued(g->display, QueuedAfterReading);
+}
+
+static void proxy(Ghandles *g)
+{
+	struct event_queue queues[2] = {
+		{ .name = "daemon messages", .run = run_messages, .arg = g,
+		  .input = 1, .budget = MESSAGE_BUDGET },
+		{ .name = "X events", .run = run_xevents,
+		  .depth = xevents_depth, .arg = g, .budget = XEVENT_BUDGET,
+		  .budget_us = XEVENT_BUDGET_US },
+	};
+	Display *dpy = g->display;
+	int more = 0;
+
+	if (event_loop_init(&g->events) != 0)
+		exit(EXIT_FAILURE);
+	/* the daemon writes the eventfd for each message it sends: each of
+	 * them is one new edge, whether or not the previous ones were read */
+	if (event_add_fd(&g->events, g->xchan->event_fd, 1, xchan_notified,
+			 g->xchan) == NULL)
+		exit(EXIT_FAILURE);
+	/* X events are read by Xlib, the source only wakes the loop up */
+	if (event_add_fd(&g->events, ConnectionNumber(dpy), 0, NULL,
+			 NULL) == NULL)
+		exit(EXIT_FAILURE);
+	/* each pass sends what it can, the timer only wakes the loop up */
+	g->send_timer = event_add_timer(&g->events, NULL, NULL);
+	if (g->send_timer == NULL)
+		exit(EXIT_FAILURE);
+
+	while (1) {
+		/* events already read by Xlib don't make its fd readable,
+		 * neither do messages left by the previous pass */
+		if (event_wait(&g->events, (more ||
+			       XEventsQueued(dpy, QueuedAlready)) ? 0 : -1) != 0)
+			break;
 
-		} while (busy);
+		/* messages produced by this batch are sent at once */
+		cork_output(g->xchan);
+		/* requests are flushed once per pass */
+		more = event_schedule(queues, 2);
+
+		event_run_timers(&g->events);
+		flush_damage(g);
+		flush_output(g->xchan);
+		XFlush(dpy);
+		if (g->log_level > 1) {
+			report_output_stats();
+			event_report_queues(queues, 2);
+		}
+
+		/* damage still pending was held back, it is sent once the
+		 * daemon had time to catch up */
+		if (g->damage_pending)
+			event_arm_timer(g->send_timer, output_backlog_ms());
+		else
+			event_disarm_timer(g->send_timer);
 	}
 
 	exit(EXIT_SUCCESS);
@@ -265,6 +340,11 @@ static void mkghandles(Ghandles * g)
 
 	g->clipboard_data = NULL;
 	g->clipboard_data_len = 0;
+	memset(&g->incr_send, 0, sizeof(g->incr_send));
+	memset(&g->incr_recv, 0, sizeof(g->incr_recv));
+	/* for selections received incrementally */
+	XSelectInput(g->display, g->stub_win, PropertyChangeMask);
+	g->damage_pending = 0;
 	snprintf(tray_sel_atom_name, sizeof(tray_sel_atom_name),
 		 "_NET_SYSTEM_TRAY_S%u", DefaultScreen(g->display));
 	g->tray_selection =
@@ -280,11 +360,12 @@ static void mkghandles(Ghandles * g)
 
 static void usage(char *argv0)
 {
-	fprintf(stderr, "Usage: %s [-d] [-v] [-q] [-h] [-u uid:gid] [-p devicereadyfd ] <pipefd>\n", argv0);
+	fprintf(stderr, "Usage: %s [-d] [-v] [-q] [-h] [-S] [-u uid:gid] [-p devicereadyfd ] <pipefd>\n", argv0);
 	fprintf(stderr, "       -d  no capsule\n");
 	fprintf(stderr, "       -v  increase log verbosity\n");
 	fprintf(stderr, "       -q  decrease log verbosity\n");
 	fprintf(stderr, "       -m  sync all modifiers before key event (default: only Caps Lock)\n");
+	fprintf(stderr, "       -S  send damage even if window content did not change\n");
 	fprintf(stderr, "       -u  specify user and group to use\n");
 	fprintf(stderr, "       -h  print this message\n");
 	fprintf(stderr, "\n");
@@ -304,8 +385,9 @@ static void parse_args(Ghandles * g, int argc, char **argv)
 	g->debug = false;
 	g->userspec = NULL;
 	g->pipe_device_ready_w = -1;
+	g->tile_filter = 1;
 
-	while ((opt = getopt(argc, argv, "dqvhmp:u:")) != -1) {
+	while ((opt = getopt(argc, argv, "dqvhmSp:u:")) != -1) {
 		switch (opt) {
 		case 'd':
 			g->debug = true;
@@ -319,6 +401,9 @@ static void parse_args(Ghandles * g, int argc, char **argv)
 		case 'm':
 			g->sync_all_modifiers = 1;
 			break;
+		case 'S':
+			g->tile_filter = 0;
+			break;
 		case 'p':
 			g->pipe_device_ready_w = atoi(optarg);
 			break;
@@ -337,6 +422,7 @@ static void parse_args(Ghandles * g, int argc, char **argv)
 
 int main(int argc, char *argv[])
 {
+	int fixes_event, fixes_error, fixes_major = 2, fixes_minor = 0;
 	int i, pipefd;
 	Ghandles g;
 	char c;
@@ -371,6 +457,14 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
+	if (!XFixesQueryExtension(g.display, &fixes_event, &fixes_error) ||
+	    !XFixesQueryVersion(g.display, &fixes_major, &fixes_minor)) {
+		fprintf(stderr, "XFixes extension not available\n");
+		exit(1);
+	}
+	g.damage_parts = XFixesCreateRegion(g.display, NULL, 0);
+	tiles_init(&g);
+
 	XAutoRepeatOff(g.display);
 
 	signal(SIGCHLD, SIG_IGN);
@@ -416,6 +510,9 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	/* until the daemon sends its capabilities, if it ever does */
+	g.features = 0;
+
 	proxy(&g);
 
 	return 0;
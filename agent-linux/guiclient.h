@@ -1,14 +1,49 @@
 #ifndef _GUICLIENT_H
 #define _GUICLIENT_H 1
 
+#include <time.h>
+#include <stdint.h>
 #include <stdbool.h>
 
 #include <X11/Xlibint.h>
 #include <X11/Xutil.h>
 #include <X11/Xatom.h>
+#include <X11/extensions/XShm.h>
+
+#include "damage.h"
+#include "event.h"
+
+/* pending damage is sent at the end of each batch of events, or sooner if
+ * it has been waiting for more than this number of milliseconds */
+#define DAMAGE_FLUSH_BUDGET_MS	8
+/* the main loop runs daemon messages, input first of all, then X events,
+ * in rounds: a round runs at most this number of each, and X events no
+ * longer than this budget */
+#define MESSAGE_BUDGET		64
+#define XEVENT_BUDGET		32
+#define XEVENT_BUDGET_US	2000
+/* protocol features offered to the daemon, see struct msg_capabilities */
+#define AGENT_FEATURES		CAP_SHMIMAGE_BATCH
+/* windows reporting more damage events per second than this switch to
+ * XDamageReportNonEmpty, and fetch the accumulated region when flushing */
+#define DAMAGE_NONEMPTY_RATE	500
+/* ...and go back to raw rectangles below this number of flushes per second */
+#define DAMAGE_RAW_RATE		30
 
 struct xchan;
 
+/* clipboard content in transfer, see clipboard.c */
+struct clipboard_stream {
+	int active;
+	unsigned char *data;
+	size_t size;		/* allocated */
+	size_t len;		/* received so far, or to send */
+	size_t off;		/* sent so far */
+	Window window;		/* INCR: window and property of the transfer */
+	Atom property;
+	Atom type;
+};
+
 struct _global_handles {
 	Display *display;
 	int screen;		/* shortcut to the default screen */
@@ -30,6 +65,20 @@ struct _global_handles {
 	unsigned int clipboard_data_len;
 	int log_level;
 	int sync_all_modifiers;
+	int damage_pending;	/* some window has damage not sent yet */
+	struct timespec damage_since;	/* time of the oldest pending damage */
+	XID damage_parts;	/* XFixes region receiving damage fetched with XDamageSubtract */
+	int tile_filter;	/* drop damage of tiles whose content did not change */
+	XShmSegmentInfo tile_shminfo;	/* segment receiving the pixels to hash */
+	size_t tile_shm_size;	/* 0 if no segment is attached */
+	unsigned long damage_pixels_in;	/* damaged pixels before and after filtering */
+	unsigned long damage_pixels_out;
+	struct timespec damage_stats_since;
+	uint32_t features;	/* protocol features both sides support */
+	struct clipboard_stream incr_send;	/* to an X client */
+	struct clipboard_stream incr_recv;	/* from an X client */
+	struct event_loop events;	/* main loop sources */
+	struct event_source *send_timer;	/* wakes the loop up to send held back output */
 
 	struct xchan *xchan;
 	bool debug;
@@ -42,6 +91,19 @@ struct window_data {
 	XID embeder;   /* for docked icon points embeder window */
 	int input_hint; /* the window should get input focus - False=Never */
 	int support_take_focus;
+	struct damage_region damage; /* damage not yet sent to dom0 */
+	XID damage_handle;	/* Damage object, None for InputOnly windows */
+	int damage_level;	/* XDamageReportRawRectangles or XDamageReportNonEmpty */
+	int damage_fetch;	/* damage must be fetched from the X server on next flush */
+	int damage_events;	/* damage events received since damage_rate_since */
+	struct timespec damage_rate_since;
+	int is_mapped;
+	int depth;		/* depth of the window, for XShmGetImage */
+	Visual *visual;
+	int tiles_width;	/* size of window buffer, as sent in MSG_MFNDUMP */
+	int tiles_height;
+	uint64_t *tile_hashes;	/* TILE_SIZE squares of window buffer, NULL if unknown */
+	unsigned char *tile_state;
 };
 
 struct embeder_data {
@@ -54,8 +116,9 @@ typedef struct _global_handles Ghandles;
 
 extern int damage_event, damage_error;
 
-bool handle_message(Ghandles *g);
+unsigned int handle_messages(Ghandles *g, unsigned int max);
 void process_xevent(Ghandles * g);
+void flush_damage(Ghandles * g);
 
 #endif /* _GUICLIENT_H */
 
@@ -33,37 +33,36 @@
 #include "list.h"
 #include "gui_common.h"
 #include "common.h"
+#include "clipboard.h"
 #include "xchan.h"
 
 #define TRUE true
 
 
-static void handle_configure(Ghandles * g, XID winid)
+static void handle_configure(Ghandles * g, XID winid, void *payload)
 {
-	struct msg_configure r;
+	struct msg_configure *r = payload;
 	struct genlist *l = list_lookup(windows_list, winid);
 	XWindowAttributes attr;
 	XGetWindowAttributes(g->display, winid, &attr);
-	read_data(g->xchan, (char *) &r, sizeof(r));
 	if (l && l->data && ((struct window_data*)l->data)->is_docked) {
-		XMoveResizeWindow(g->display, ((struct window_data*)l->data)->embeder, r.x, r.y, r.width, r.height);
-		XMoveResizeWindow(g->display, winid, 0, 0, r.width, r.height);
+		XMoveResizeWindow(g->display, ((struct window_data*)l->data)->embeder, r->x, r->y, r->width, r->height);
+		XMoveResizeWindow(g->display, winid, 0, 0, r->width, r->height);
 	} else {
-		XMoveResizeWindow(g->display, winid, r.x, r.y, r.width, r.height);
+		XMoveResizeWindow(g->display, winid, r->x, r->y, r->width, r->height);
 	}
 
 	DBG0("configure msg, x/y %d %d (was %d %d), w/h %d %d (was %d %d)\n",
-		r.x, r.y, attr.x, attr.y, r.width, r.height, attr.width,
+		r->x, r->y, attr.x, attr.y, r->width, r->height, attr.width,
 		attr.height);
 
 }
 
-static void handle_map(Ghandles * g, XID winid)
+static void handle_map(Ghandles * g, XID winid, void *payload)
 {
-	struct msg_map_info inf;
+	struct msg_map_info *inf = payload;
 	XSetWindowAttributes attr;
-	read_data(g->xchan, (char *) &inf, sizeof(inf));
-	attr.override_redirect = inf.override_redirect;
+	attr.override_redirect = inf->override_redirect;
 	XChangeWindowAttributes(g->display, winid,
 				CWOverrideRedirect, &attr);
 	XMapWindow(g->display, winid);
@@ -71,7 +70,7 @@ static void handle_map(Ghandles * g, XID winid)
 	DBG1("map msg for 0x%x\n", (int)winid);
 }
 
-static void handle_close(Ghandles * g, XID winid)
+static void handle_close(Ghandles * g, XID winid, void *UNUSED(payload))
 {
 	XClientMessageEvent ev;
 	memset(&ev, 0, sizeof(ev));
@@ -87,14 +86,13 @@ static void handle_close(Ghandles * g, XID winid)
 	DBG0("wmDeleteMessage sent for 0x%x\n", (int)winid);
 }
 
-static void handle_button(Ghandles * g, XID winid)
+static void handle_button(Ghandles * g, XID winid, void *payload)
 {
-	struct msg_button key;
+	struct msg_button *key = payload;
 //      XButtonEvent event;
 	XWindowAttributes attr;
 	int ret;
 
-	read_data(g->xchan, (char *) &key, sizeof(key));
 	ret = XGetWindowAttributes(g->display, winid, &attr);
 	if (ret != 1) {
 		fprintf(stderr,
@@ -111,14 +109,14 @@ static void handle_button(Ghandles * g, XID winid)
 	event.root = g->root_win;
 	event.subwindow = None;
 	event.time = CurrentTime;
-	event.x = key.x;
-	event.y = key.y;
-	event.x_root = attr.x + key.x;
-	event.y_root = attr.y + key.y;
+	event.x = key->x;
+	event.y = key->y;
+	event.x_root = attr.x + key->x;
+	event.y_root = attr.y + key->y;
 	event.same_screen = TRUE;
-	event.type = key.type;
-	event.button = key.button;
-	event.state = key.state;
+	event.type = key->type;
+	event.button = key->button;
+	event.state = key->state;
 	XSendEvent(event.display, event.window, TRUE,
 //                 event.type==KeyPress?KeyPressMask:KeyReleaseMask, 
 		   ButtonPressMask, (XEvent *) & event);
@@ -126,20 +124,19 @@ static void handle_button(Ghandles * g, XID winid)
 #endif
 
 	DBG1("send buttonevent, win 0x%x type=%d button=%d\n",
-		(int)winid, key.type, key.button);
+		(int)winid, key->type, key->button);
 
-	feed_xdriver(g, 'B', key.button, key.type == ButtonPress ? 1 : 0);
+	feed_xdriver(g, 'B', key->button, key->type == ButtonPress ? 1 : 0);
 }
 
-static void handle_motion(Ghandles * g, XID winid)
+static void handle_motion(Ghandles * g, XID winid, void *payload)
 {
-	struct msg_motion key;
+	struct msg_motion *key = payload;
 //      XMotionEvent event;
 	XWindowAttributes attr;
 	int ret;
 	struct genlist *l = list_lookup(windows_list, winid);
 
-	read_data(g->xchan, (char *) &key, sizeof(key));
 	if (l && l->data && ((struct window_data*)l->data)->is_docked) {
 		/* get position of embeder, not icon itself*/
 		winid = ((struct window_data*)l->data)->embeder;
@@ -158,13 +155,13 @@ static void handle_motion(Ghandles * g, XID winid)
 	event.root = g->root_win;
 	event.subwindow = None;
 	event.time = CurrentTime;
-	event.x = key.x;
-	event.y = key.y;
-	event.x_root = attr.x + key.x;
-	event.y_root = attr.y + key.y;
+	event.x = key->x;
+	event.y = key->y;
+	event.x_root = attr.x + key->x;
+	event.y_root = attr.y + key->y;
 	event.same_screen = TRUE;
-	event.is_hint = key.is_hint;
-	event.state = key.state;
+	event.is_hint = key->is_hint;
+	event.state = key->state;
 	event.type = MotionNotify;
 //      fprintf(stderr, "motion notify for 0x%x\n", (int)winid);
 	XSendEvent(event.display, event.window, TRUE,
@@ -172,14 +169,14 @@ static void handle_motion(Ghandles * g, XID winid)
 		   0, (XEvent *) & event);
 //      XSync(g->display, 0);
 #endif
-	feed_xdriver(g, 'M', attr.x + key.x, attr.y + key.y);
+	feed_xdriver(g, 'M', attr.x + key->x, attr.y + key->y);
 }
 
 // ensure that LeaveNotify is delivered to the window - if pointer is still
 // above this window, place stub window between pointer and the window
-static void handle_crossing(Ghandles * g, XID winid)
+static void handle_crossing(Ghandles * g, XID winid, void *payload)
 {
-	struct msg_crossing key;
+	struct msg_crossing *key = payload;
 	XWindowAttributes attr;
 	int ret;
 	struct genlist *l = list_lookup(windows_list, winid);
@@ -191,7 +188,6 @@ static void handle_crossing(Ghandles * g, XID winid)
 		winid = ((struct window_data*)l->data)->embeder;
 	}
 
-	read_data(g->xchan, (char *) &key, sizeof(key));
 
 	ret = XGetWindowAttributes(g->display, winid, &attr);
 	if (ret != 1) {
@@ -201,10 +197,10 @@ static void handle_crossing(Ghandles * g, XID winid)
 		return;
 	}
 
-	if (key.type == EnterNotify) {
+	if (key->type == EnterNotify) {
 		// hide stub window
 		XUnmapWindow(g->display, g->stub_win);
-	} else if (key.type == LeaveNotify) {
+	} else if (key->type == LeaveNotify) {
 		XID window_under_pointer, root_returned;
 		int root_x, root_y, win_x, win_y;
 		unsigned int mask_return;
@@ -228,22 +224,21 @@ static void handle_crossing(Ghandles * g, XID winid)
 			XRaiseWindow(g->display, g->stub_win);
 		}
 	} else {
-		fprintf(stderr, "Invalid crossing event: %d\n", key.type);
+		fprintf(stderr, "Invalid crossing event: %d\n", key->type);
 	}
 
 }
 
-static void handle_keypress(Ghandles * g, XID UNUSED(winid))
+static void handle_keypress(Ghandles * g, XID UNUSED(winid), void *payload)
 {
-	struct msg_keypress key;
+	struct msg_keypress *key = payload;
 	XkbStateRec state;
 //      XKeyEvent event;
 //        char buf[256];
-	read_data(g->xchan, (char *) &key, sizeof(key));
 #if 0
 //XGetInputFocus(g->display, &focus_return, &revert_to_return);
-//      fprintf(stderr, "vmside: type=%d keycode=%d currfoc=0x%x\n", key.type,
-//              key.keycode, (int)focus_return);
+//      fprintf(stderr, "vmside: type=%d keycode=%d currfoc=0x%x\n", key->type,
+//              key->keycode, (int)focus_return);
 
 //      XSetInputFocus(g->display, winid, RevertToParent, CurrentTime);
 	event.display = g->display;
@@ -251,14 +246,14 @@ static void handle_keypress(Ghandles * g, XID UNUSED(winid))
 	event.root = g->root_win;
 	event.subwindow = None;
 	event.time = CurrentTime;
-	event.x = key.x;
-	event.y = key.y;
+	event.x = key->x;
+	event.y = key->y;
 	event.x_root = 1;
 	event.y_root = 1;
 	event.same_screen = TRUE;
-	event.type = key.type;
-	event.keycode = key.keycode;
-	event.state = key.state;
+	event.type = key->type;
+	event.keycode = key->keycode;
+	event.state = key->state;
 	XSendEvent(event.display, event.window, TRUE,
 //                 event.type==KeyPress?KeyPressMask:KeyReleaseMask, 
 		   KeyPressMask, (XEvent *) & event);
@@ -266,14 +261,14 @@ static void handle_keypress(Ghandles * g, XID UNUSED(winid))
 	// sync modifiers state
 	if (XkbGetState(g->display, XkbUseCoreKbd, &state) != Success) {
 		DBG0("failed to get modifier state\n");
-		state.mods = key.state;
+		state.mods = key->state;
 	}
 	if (!g->sync_all_modifiers) {
 		// ignore all but CapsLock
 		state.mods &= LockMask;
-		key.state &= LockMask;
+		key->state &= LockMask;
 	}
-	if (state.mods != key.state) {
+	if (state.mods != key->state) {
 		XModifierKeymap *modmap;
 		int mod_index;
 		int mod_mask;
@@ -301,14 +296,14 @@ static void handle_keypress(Ghandles * g, XID UNUSED(winid))
 				mod_mask = (1<<mod_index);
 				// special case for caps lock switch by press+release
 				if (mod_index == LockMapIndex) {
-					if ((state.mods & mod_mask) ^ (key.state & mod_mask)) {
+					if ((state.mods & mod_mask) ^ (key->state & mod_mask)) {
 						feed_xdriver(g, 'K', modmap->modifiermap[mod_index*modmap->max_keypermod], 1);
 						feed_xdriver(g, 'K', modmap->modifiermap[mod_index*modmap->max_keypermod], 0);
 					}
 				} else {
-					if ((state.mods & mod_mask) && !(key.state & mod_mask))
+					if ((state.mods & mod_mask) && !(key->state & mod_mask))
 						feed_xdriver(g, 'K', modmap->modifiermap[mod_index*modmap->max_keypermod], 0);
-					else if (!(state.mods & mod_mask) && (key.state & mod_mask))
+					else if (!(state.mods & mod_mask) && (key->state & mod_mask))
 						feed_xdriver(g, 'K', modmap->modifiermap[mod_index*modmap->max_keypermod], 1);
 				}
 			}
@@ -316,10 +311,10 @@ static void handle_keypress(Ghandles * g, XID UNUSED(winid))
 		}
 	}
 
-	feed_xdriver(g, 'K', key.keycode, key.type == KeyPress ? 1 : 0);
+	feed_xdriver(g, 'K', key->keycode, key->type == KeyPress ? 1 : 0);
 #endif
 //      fprintf(stderr, "win 0x%x type %d keycode %d\n",
-//              (int) winid, key.type, key.keycode);
+//              (int) winid, key->type, key->keycode);
 //      XSync(g->display, 0);
 }
 
@@ -341,29 +336,28 @@ void take_focus(Ghandles * g, XID winid)
 
 }
 
-static void handle_focus(Ghandles * g, XID winid)
+static void handle_focus(Ghandles * g, XID winid, void *payload)
 {
-	struct msg_focus key;
+	struct msg_focus *key = payload;
 	struct genlist *l;
 	int input_hint;
 	int use_take_focus;
 //      XFocusChangeEvent event;
 
-	read_data(g->xchan, (char *) &key, sizeof(key));
 #if 0
 	event.display = g->display;
 	event.window = winid;
-	event.type = key.type;
-	event.mode = key.mode;
-	event.detail = key.detail;
+	event.type = key->type;
+	event.mode = key->mode;
+	event.detail = key->detail;
 
 	fprintf(stderr, "send focuschange for 0x%x type %d\n",
-		(int) winid, key.type);
+		(int) winid, key->type);
 	XSendEvent(event.display, event.window, TRUE,
 		   0, (XEvent *) & event);
 #endif
-	if (key.type == FocusIn
-	    && (key.mode == NotifyNormal || key.mode == NotifyUngrab)) {
+	if (key->type == FocusIn
+	    && (key->mode == NotifyNormal || key->mode == NotifyUngrab)) {
 
 		XRaiseWindow(g->display, winid);
 
@@ -386,9 +380,9 @@ static void handle_focus(Ghandles * g, XID winid)
 			take_focus(g, winid);
 
 		DBG1("0x%x raised\n", (int)winid);
-	} else if (key.type == FocusOut
-		   && (key.mode == NotifyNormal
-		       || key.mode == NotifyUngrab)) {
+	} else if (key->type == FocusOut
+		   && (key->mode == NotifyNormal
+		       || key->mode == NotifyUngrab)) {
 
 		XSetInputFocus(g->display, None, RevertToParent,
 			       CurrentTime);
@@ -399,7 +393,8 @@ static void handle_focus(Ghandles * g, XID winid)
 }
 
 #define CLIPBOARD_4WAY
-void handle_clipboard_req(Ghandles * g, XID UNUSED(winid))
+void handle_clipboard_req(Ghandles * g, XID UNUSED(winid),
+			  void *UNUSED(payload))
 {
 	Atom Clp;
 	Atom QProp = XInternAtom(g->display, "QUBES_SELECTION", False);
@@ -420,29 +415,22 @@ void handle_clipboard_req(Ghandles * g, XID UNUSED(winid))
 			  g->stub_win, CurrentTime);
 }
 
-static void handle_clipboard_data(Ghandles * g, int len)
+/* the window field of the header is the length of the data */
+static void handle_clipboard_data(Ghandles * g, XID winid,
+				  void *UNUSED(payload))
 {
-	Atom Clp = XInternAtom(g->display, "CLIPBOARD", False);
+	int len = winid;
+	unsigned char *data;
 
-	if (g->clipboard_data)
-		free(g->clipboard_data);
 	// qubes_guid will not bother to send len==-1, really
-	g->clipboard_data = malloc(len + 1);
-	if (!g->clipboard_data) {
+	data = malloc(len + 1);
+	if (!data) {
 		perror("malloc");
 		exit(1);
 	}
-	g->clipboard_data_len = len;
-	read_data(g->xchan, (char *) g->clipboard_data, len);
-	g->clipboard_data[len] = 0;
-	XSetSelectionOwner(g->display, XA_PRIMARY, g->stub_win,
-			   CurrentTime);
-	XSetSelectionOwner(g->display, Clp, g->stub_win, CurrentTime);
-#ifndef CLIPBOARD_4WAY
-	XSync(g->display, False);
-	feed_xdriver(g, 'B', 2, 1);
-	feed_xdriver(g, 'B', 2, 0);
-#endif
+	read_data(g->xchan, (char *) data, len);
+	data[len] = 0;
+	set_clipboard(g, data, len);
 }
 
 static void do_execute(char *user, char *cmd)
@@ -469,19 +457,19 @@ static void do_execute(char *user, char *cmd)
 	}
 }
 
-static void handle_execute(Ghandles * g)
+static void handle_execute(Ghandles * UNUSED(g), XID UNUSED(winid),
+			   void *payload)
 {
 	char *ptr;
-	struct msg_execute exec_data;
-	read_data(g->xchan, (char *) &exec_data, sizeof(exec_data));
-	exec_data.cmd[sizeof(exec_data.cmd) - 1] = 0;
-	ptr = index(exec_data.cmd, ':');
+	struct msg_execute *exec_data = payload;
+	exec_data->cmd[sizeof(exec_data->cmd) - 1] = 0;
+	ptr = index(exec_data->cmd, ':');
 	if (!ptr)
 		return;
 	*ptr = 0;
 	fprintf(stderr, "handle_execute(): cmd = %s:%s\n",
-		exec_data.cmd, ptr + 1);
-	do_execute(exec_data.cmd, ptr + 1);
+		exec_data->cmd, ptr + 1);
+	do_execute(exec_data->cmd, ptr + 1);
 }
 
 static int bitset(unsigned char *keys, int num)
@@ -489,13 +477,12 @@ static int bitset(unsigned char *keys, int num)
 	return (keys[num / 8] >> (num % 8)) & 1;
 }
 
-static void handle_keymap_notify(Ghandles * g)
+static void handle_keymap_notify(Ghandles * g, XID UNUSED(winid),
+				 void *payload)
 {
-	unsigned char remote_keys[32], local_keys[32];
+	unsigned char *remote_keys = payload, local_keys[32];
 	int i;
 
-	read_struct(g->xchan, remote_keys);
-
 	XQueryKeymap(g->display, (char *)local_keys);
 	for (i = 0; i < 256; i++) {
 		if (!bitset(remote_keys, i) && bitset(local_keys, i)) {
@@ -505,7 +492,7 @@ static void handle_keymap_notify(Ghandles * g)
 	}
 }
 
-static void handle_window_flags(Ghandles *g, XID winid)
+static void handle_window_flags(Ghandles *g, XID winid, void *payload)
 {
 	int ret, j, changed;
 	unsigned i;
@@ -515,8 +502,7 @@ static void handle_window_flags(Ghandles *g, XID winid)
 	int act_fmt;
 	uint32_t tmp_flag;
 	unsigned long nitems, bytesleft;
-	struct msg_window_flags msg_flags;
-	read_data(g->xchan, (char *) &msg_flags, sizeof(msg_flags));
+	struct msg_window_flags *msg_flags = payload;
 
 	/* FIXME: only first 10 elements are parsed */
 	ret = XGetWindowProperty(g->display, winid, g->wm_state, 0, 10,
@@ -528,10 +514,10 @@ static void handle_window_flags(Ghandles *g, XID winid)
 	changed = 0;
 	for (i=0; i < nitems; i++) {
 		tmp_flag = flags_from_atom(g, state_list[i]);
-		if (tmp_flag && tmp_flag & msg_flags.flags_set) {
+		if (tmp_flag && tmp_flag & msg_flags->flags_set) {
 			/* leave flag set, mark as processed */
-			msg_flags.flags_set &= ~tmp_flag;
-		} else if (tmp_flag && tmp_flag & msg_flags.flags_unset) {
+			msg_flags->flags_set &= ~tmp_flag;
+		} else if (tmp_flag && tmp_flag & msg_flags->flags_unset) {
 			/* skip this flag (remove) */
 			changed = 1;
 			continue;
@@ -541,12 +527,12 @@ static void handle_window_flags(Ghandles *g, XID winid)
 	}
 	XFree(state_list);
 	/* set new elements */
-	if (msg_flags.flags_set & WINDOW_FLAG_FULLSCREEN)
+	if (msg_flags->flags_set & WINDOW_FLAG_FULLSCREEN)
 		new_state_list[j++] = g->wm_state_fullscreen;
-	if (msg_flags.flags_set & WINDOW_FLAG_DEMANDS_ATTENTION)
+	if (msg_flags->flags_set & WINDOW_FLAG_DEMANDS_ATTENTION)
 		new_state_list[j++] = g->wm_state_demands_attention;
 
-	if (msg_flags.flags_set)
+	if (msg_flags->flags_set)
 		changed = 1;
 
 	if (!changed)
@@ -555,9 +541,53 @@ static void handle_window_flags(Ghandles *g, XID winid)
 	XChangeProperty(g->display, winid, g->wm_state, XA_ATOM, 32, PropModeReplace, (unsigned char *)new_state_list, j);
 }
 
+/* enable the features supported by both sides and answer with ours */
+static void handle_capabilities(Ghandles * g, XID UNUSED(winid), void *payload)
+{
+	struct msg_capabilities *caps = payload;
+	struct msg_capabilities reply;
+	struct msg_hdr hdr;
+
+	g->features = caps->features & AGENT_FEATURES;
+	DBG0("protocol features: 0x%x\n", g->features);
+
+	hdr.type = MSG_CAPABILITIES;
+	hdr.window = 0;
+	reply.features = AGENT_FEATURES;
+	write_message(g->xchan, hdr, reply);
+}
+
+/* handlers of daemon messages, indexed by type; the fixed part of the
+ * payload (size bytes) is received before the handler is called */
+static const struct message_handler {
+	void (*handle)(Ghandles * g, XID winid, void *payload);
+	size_t size;
+} handlers[MSG_MAX] = {
+	[MSG_KEYPRESS] = { handle_keypress, sizeof(struct msg_keypress) },
+	[MSG_CONFIGURE] = { handle_configure, sizeof(struct msg_configure) },
+	[MSG_MAP] = { handle_map, sizeof(struct msg_map_info) },
+	[MSG_BUTTON] = { handle_button, sizeof(struct msg_button) },
+	[MSG_MOTION] = { handle_motion, sizeof(struct msg_motion) },
+	[MSG_CLOSE] = { handle_close, 0 },
+	[MSG_CROSSING] = { handle_crossing, sizeof(struct msg_crossing) },
+	[MSG_FOCUS] = { handle_focus, sizeof(struct msg_focus) },
+	[MSG_CLIPBOARD_REQ] = { handle_clipboard_req, 0 },
+	[MSG_CLIPBOARD_DATA] = { handle_clipboard_data, 0 },
+	[MSG_EXECUTE] = { handle_execute, sizeof(struct msg_execute) },
+	[MSG_KEYMAP_NOTIFY] = { handle_keymap_notify,
+				sizeof(struct msg_keymap_notify) },
+	[MSG_WINDOW_FLAGS] = { handle_window_flags,
+			       sizeof(struct msg_window_flags) },
+	[MSG_CAPABILITIES] = { handle_capabilities,
+			       sizeof(struct msg_capabilities) },
+};
+
+static struct message_stats stats;
+
 /* return false if no message is available, true otherwise */
-bool handle_message(Ghandles *g)
+static bool handle_message(Ghandles *g)
 {
+	const struct message_handler *h;
 	struct msg_hdr hdr;
 	char discard[256];
 	unsigned char *p;
@@ -587,54 +617,38 @@ bool handle_message(Ghandles *g)
 
 	DBG1("received message type %d for 0x%x\n", hdr.type, hdr.window);
 
-	switch (hdr.type) {
-	case MSG_KEYPRESS:
-		handle_keypress(g, hdr.window);
-		break;
-	case MSG_CONFIGURE:
-		handle_configure(g, hdr.window);
-		break;
-	case MSG_MAP:
-		handle_map(g, hdr.window);
-		break;
-	case MSG_BUTTON:
-		handle_button(g, hdr.window);
-		break;
-	case MSG_MOTION:
-		handle_motion(g, hdr.window);
-		break;
-	case MSG_CLOSE:
-		handle_close(g, hdr.window);
-		break;
-	case MSG_CROSSING:
-		handle_crossing(g, hdr.window);
-		break;
-	case MSG_FOCUS:
-		handle_focus(g, hdr.window);
-		break;
-	case MSG_CLIPBOARD_REQ:
-		handle_clipboard_req(g, hdr.window);
-		break;
-	case MSG_CLIPBOARD_DATA:
-		handle_clipboard_data(g, hdr.window);
-		break;
-	case MSG_EXECUTE:
-		handle_execute(g);
-		break;
-	case MSG_KEYMAP_NOTIFY:
-		handle_keymap_notify(g);
-		break;
-	case MSG_WINDOW_FLAGS:
-		handle_window_flags(g, hdr.window);
-		break;
-	default:
+	if (hdr.type <= MSG_MIN || hdr.type >= MSG_MAX ||
+	    !handlers[hdr.type].handle) {
 		fprintf(stderr, "got unknown msg type %d, ignoring\n", hdr.type);
 		while (hdr.untrusted_len > 0) {
 			hdr.untrusted_len -= read_data(g->xchan, discard, min(hdr.untrusted_len, sizeof(discard)));
 		}
+		return true;
 	}
 
+	stats.count[hdr.type - MSG_MIN]++;
+	stats.messages++;
+	release_views();
+	h = &handlers[hdr.type];
+	h->handle(g, hdr.window, read_view(g->xchan, h->size));
+
 	return true;
 }
 
+/* handle the messages already received from the daemon, at most max of them
+ * return the number of messages handled */
+unsigned int handle_messages(Ghandles *g, unsigned int max)
+{
+	unsigned int n;
+
+	n = 0;
+	while (n < max && handle_message(g))
+		n++;
+	if (n > 0)
+		stats.wakeups++;
+	if (g->log_level > 1)
+		report_message_stats(&stats);
+	return n;
+}
+
 // vim: noet:ts=8:
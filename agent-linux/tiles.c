@@ -0,0 +1,281 @@
+/*
+ * Suppression of damage which doesn't change any pixel.
+ *
+ * Toolkits often repaint areas whose content is identical (blinking cursor
+ * drawn twice, idle animations, redundant exposes). Each window buffer is
+ * split into TILE_SIZE squares whose hash is remembered; before pending
+ * damage is sent, the damaged tiles are fetched from the X server with
+ * XShmGetImage and hashed again, and damage is replaced by the tiles whose
+ * hash changed. A changed tile is sent whole: its hash covers every pixel of
+ * it, including the ones outside of the damage, which dom0 must get too
+ * before they can be deemed unchanged.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include "guiclient.h"
+#include "gui_common.h"
+#include "qubes-gui-protocol.h"
+#include "tilehash.h"
+#include "tiles.h"
+
+#define STATS_INTERVAL_MS	10000
+
+enum {
+	TILE_UNVISITED,
+	TILE_SAME,
+	TILE_CHANGED,
+};
+
+
+void tiles_init(Ghandles * g)
+{
+	g->tile_shm_size = 0;
+	g->damage_pixels_in = 0;
+	g->damage_pixels_out = 0;
+	clock_gettime(CLOCK_MONOTONIC, &g->damage_stats_since);
+
+	if (g->tile_filter && !XShmQueryExtension(g->display)) {
+		fprintf(stderr, "MIT-SHM not available, damage filtering disabled\n");
+		g->tile_filter = 0;
+	}
+}
+
+void tiles_free(struct window_data *wd)
+{
+	free(wd->tile_hashes);
+	free(wd->tile_state);
+	wd->tile_hashes = NULL;
+	wd->tile_state = NULL;
+}
+
+/* window buffer was (re)described: forget every tile hash */
+void tiles_reset(struct window_data *wd, int width, int height)
+{
+	size_t count;
+
+	tiles_free(wd);
+	wd->tiles_width = width;
+	wd->tiles_height = height;
+	if (width <= 0 || height <= 0)
+		return;
+
+	count = (size_t)((width + TILE_SIZE - 1) / TILE_SIZE) *
+		((height + TILE_SIZE - 1) / TILE_SIZE);
+	wd->tile_hashes = calloc(count, sizeof(*wd->tile_hashes));
+	wd->tile_state = calloc(count, sizeof(*wd->tile_state));
+	if (!wd->tile_hashes || !wd->tile_state) {
+		fprintf(stderr, "OUT OF MEMORY\n");
+		tiles_free(wd);
+	}
+}
+
+/* make sure the shared segment can hold size bytes */
+static int get_segment(Ghandles * g, size_t size)
+{
+	XShmSegmentInfo *shminfo = &g->tile_shminfo;
+
+	if (size <= g->tile_shm_size)
+		return 1;
+
+	if (g->tile_shm_size) {
+		XShmDetach(g->display, shminfo);
+		XSync(g->display, False);
+		shmdt(shminfo->shmaddr);
+		g->tile_shm_size = 0;
+	}
+
+	shminfo->shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+	if (shminfo->shmid == -1) {
+		warn("shmget");
+		return 0;
+	}
+	shminfo->shmaddr = shmat(shminfo->shmid, NULL, 0);
+	if (shminfo->shmaddr == (void *)-1) {
+		warn("shmat");
+		shmctl(shminfo->shmid, IPC_RMID, NULL);
+		return 0;
+	}
+	shminfo->readOnly = False;
+	if (!XShmAttach(g->display, shminfo)) {
+		shmdt(shminfo->shmaddr);
+		shmctl(shminfo->shmid, IPC_RMID, NULL);
+		return 0;
+	}
+	XSync(g->display, False);
+	/* segment is destroyed once both sides detached */
+	shmctl(shminfo->shmid, IPC_RMID, NULL);
+
+	g->tile_shm_size = size;
+	return 1;
+}
+
+/* hash every tile of the given tile range which wasn't visited yet during
+ * this flush */
+static void hash_tiles(Ghandles * g, XID window, struct window_data *wd,
+		       int tx0, int ty0, int tx1, int ty1)
+{
+	int tiles_x = (wd->tiles_width + TILE_SIZE - 1) / TILE_SIZE;
+	int x, y, w, h, tx, ty, i, unvisited;
+	unsigned char *p;
+	XImage *image;
+	uint64_t hash;
+
+	unvisited = 0;
+	for (ty = ty0; ty <= ty1 && !unvisited; ty++)
+		for (tx = tx0; tx <= tx1; tx++)
+			if (wd->tile_state[ty * tiles_x + tx] == TILE_UNVISITED)
+				unvisited = 1;
+	if (!unvisited)
+		return;
+
+	x = tx0 * TILE_SIZE;
+	y = ty0 * TILE_SIZE;
+	w = min((tx1 + 1) * TILE_SIZE, wd->tiles_width) - x;
+	h = min((ty1 + 1) * TILE_SIZE, wd->tiles_height) - y;
+
+	image = NULL;
+	if (get_segment(g, (size_t)w * h * (DUMMY_DRV_FB_BPP / 8))) {
+		image = XShmCreateImage(g->display, wd->visual, wd->depth,
+					ZPixmap, g->tile_shminfo.shmaddr,
+					&g->tile_shminfo, w, h);
+		if (image && (image->bits_per_pixel != DUMMY_DRV_FB_BPP ||
+			      !XShmGetImage(g->display, window, image, x, y,
+					    AllPlanes))) {
+			XDestroyImage(image);
+			image = NULL;
+		}
+	}
+
+	for (ty = ty0; ty <= ty1; ty++) {
+		for (tx = tx0; tx <= tx1; tx++) {
+			i = ty * tiles_x + tx;
+			if (wd->tile_state[i] != TILE_UNVISITED)
+				continue;
+			if (!image) {
+				/* can't tell, send the damage */
+				wd->tile_hashes[i] = 0;
+				wd->tile_state[i] = TILE_CHANGED;
+				continue;
+			}
+			p = (unsigned char *)image->data +
+				(ty * TILE_SIZE - y) * image->bytes_per_line +
+				(tx * TILE_SIZE - x) * (DUMMY_DRV_FB_BPP / 8);
+			hash = tile_hash(p, image->bytes_per_line,
+					 min(TILE_SIZE, wd->tiles_width - tx * TILE_SIZE),
+					 min(TILE_SIZE, wd->tiles_height - ty * TILE_SIZE));
+			wd->tile_state[i] = (hash == wd->tile_hashes[i]) ?
+				TILE_SAME : TILE_CHANGED;
+			wd->tile_hashes[i] = hash;
+		}
+	}
+
+	if (image)
+		XDestroyImage(image);
+}
+
+/* clip rectangle to window buffer and return its tile range, or 0 if it is
+ * outside of the buffer */
+static int tile_range(const struct window_data *wd,
+		      const struct damage_rect *r,
+		      int *tx0, int *ty0, int *tx1, int *ty1)
+{
+	int x1, y1, x2, y2;
+
+	x1 = max(r->x, 0);
+	y1 = max(r->y, 0);
+	x2 = min(r->x + r->width, wd->tiles_width);
+	y2 = min(r->y + r->height, wd->tiles_height);
+	if (x1 >= x2 || y1 >= y2)
+		return 0;
+
+	*tx0 = x1 / TILE_SIZE;
+	*ty0 = y1 / TILE_SIZE;
+	*tx1 = (x2 - 1) / TILE_SIZE;
+	*ty1 = (y2 - 1) / TILE_SIZE;
+	return 1;
+}
+
+/* replace pending damage of a window by the tiles whose content changed
+ * tiles are hashed once, even if several damaged rectangles cover them, and
+ * the changed ones are then sent whole, clipped to the buffer */
+void filter_window_damage(Ghandles * g, XID window, struct window_data *wd)
+{
+	int tiles_x = (wd->tiles_width + TILE_SIZE - 1) / TILE_SIZE;
+	struct damage_region in;
+	const struct damage_rect *r;
+	int tx0, ty0, tx1, ty1, tx, ty, i, x1, y1, x2, y2;
+
+	in = wd->damage;
+	damage_init(&wd->damage);
+
+	for (i = 0; i < in.count; i++) {
+		if (tile_range(wd, &in.rects[i], &tx0, &ty0, &tx1, &ty1))
+			hash_tiles(g, window, wd, tx0, ty0, tx1, ty1);
+	}
+
+	for (i = 0; i < in.count; i++) {
+		r = &in.rects[i];
+		g->damage_pixels_in += (unsigned long)r->width * r->height;
+		if (!tile_range(wd, r, &tx0, &ty0, &tx1, &ty1)) {
+			/* not covered by the buffer, let dom0 decide */
+			damage_add(&wd->damage, r->x, r->y, r->width, r->height);
+			continue;
+		}
+		for (ty = ty0; ty <= ty1; ty++) {
+			for (tx = tx0; tx <= tx1; tx++) {
+				if (wd->tile_state[ty * tiles_x + tx] != TILE_CHANGED)
+					continue;
+				x1 = tx * TILE_SIZE;
+				y1 = ty * TILE_SIZE;
+				x2 = min(x1 + TILE_SIZE, wd->tiles_width);
+				y2 = min(y1 + TILE_SIZE, wd->tiles_height);
+				damage_add(&wd->damage, x1, y1, x2 - x1, y2 - y1);
+			}
+		}
+	}
+
+	for (i = 0; i < in.count; i++) {
+		if (!tile_range(wd, &in.rects[i], &tx0, &ty0, &tx1, &ty1))
+			continue;
+		for (ty = ty0; ty <= ty1; ty++)
+			for (tx = tx0; tx <= tx1; tx++)
+				wd->tile_state[ty * tiles_x + tx] = TILE_UNVISITED;
+	}
+
+	for (i = 0; i < wd->damage.count; i++)
+		g->damage_pixels_out += (unsigned long)wd->damage.rects[i].width *
+			wd->damage.rects[i].height;
+}
+
+/* periodically log how many damaged pixels were sent; this is what the
+ * filter saves on xchan and in dom0 puts, not a measure of CPU time */
+void tiles_report(Ghandles * g)
+{
+	struct timespec now;
+	long elapsed_ms;
+
+	if (g->log_level < 1 || g->damage_pixels_in == 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed_ms = (now.tv_sec - g->damage_stats_since.tv_sec) * 1000 +
+		(now.tv_nsec - g->damage_stats_since.tv_nsec) / 1000000;
+	if (elapsed_ms < STATS_INTERVAL_MS)
+		return;
+
+	fprintf(stderr, "damage filter: %lu pixels damaged, %lu sent (%lu%%) in %lds\n",
+		g->damage_pixels_in, g->damage_pixels_out,
+		g->damage_pixels_out * 100 / g->damage_pixels_in,
+		elapsed_ms / 1000);
+	g->damage_pixels_in = 0;
+	g->damage_pixels_out = 0;
+	g->damage_stats_since = now;
+}
+
+// vim: noet:ts=8:
@@ -0,0 +1,12 @@
+#ifndef _TILES_H
+#define _TILES_H 1
+
+void tiles_init(Ghandles * g);
+void tiles_reset(struct window_data *wd, int width, int height);
+void tiles_free(struct window_data *wd);
+void filter_window_damage(Ghandles * g, XID window, struct window_data *wd);
+void tiles_report(Ghandles * g);
+
+#endif /* _TILES_H */
+
+// vim: noet:ts=8:
@@ -31,6 +31,8 @@
 #include "guiclient.h"
 #include "common.h"
 #include "list.h"
+#include "tiles.h"
+#include "clipboard.h"
 
 #define SKIP_NONMANAGED_WINDOW if (!list_lookup(windows_list, window)) return
 
@@ -79,13 +81,156 @@ static void readall(int fd, void *buf, size_t count)
 	}
 }
 
+/* send pending damage of a window, as a single MSG_SHMIMAGE or batched in
+ * MSG_SHMIMAGE_BATCH messages if the daemon supports them */
+static void send_window_damage(Ghandles * g, XID window,
+			       struct window_data *wd)
+{
+	struct msg_shmimage_batch batch;
+	struct msg_hdr hdr;
+	uint32_t max;
+	int i, size;
+
+	max = (g->features & CAP_SHMIMAGE_BATCH) ? MAX_SHMIMAGE_BATCH : 1;
+	hdr.window = window;
+	batch.count = 0;
+	for (i = 0; i < wd->damage.count; i++) {
+		batch.rects[batch.count].x = wd->damage.rects[i].x;
+		batch.rects[batch.count].y = wd->damage.rects[i].y;
+		batch.rects[batch.count].width = wd->damage.rects[i].width;
+		batch.rects[batch.count].height = wd->damage.rects[i].height;
+		batch.count++;
+
+		if (batch.count < max && i < wd->damage.count - 1)
+			continue;
+
+		if (batch.count == 1) {
+			hdr.type = MSG_SHMIMAGE;
+			write_message(g->xchan, hdr, batch.rects[0]);
+		} else {
+			hdr.type = MSG_SHMIMAGE_BATCH;
+			size = sizeof(batch.count) +
+				batch.count * sizeof(batch.rects[0]);
+			hdr.untrusted_len = size;
+			real_write_message(g->xchan, (char *)&hdr, sizeof(hdr),
+					   (char *)&batch, size);
+		}
+		batch.count = 0;
+	}
+	damage_init(&wd->damage);
+}
+
+/* move the damage accumulated by the X server for a window in
+ * XDamageReportNonEmpty mode to its pending damage */
+static void fetch_window_damage(Ghandles * g, struct window_data *wd)
+{
+	XRectangle *rects;
+	int i, count;
+
+	wd->damage_fetch = 0;
+	XDamageSubtract(g->display, wd->damage_handle, None, g->damage_parts);
+	rects = XFixesFetchRegion(g->display, g->damage_parts, &count);
+	if (!rects)
+		return;
+	for (i = 0; i < count; i++)
+		damage_add(&wd->damage, rects[i].x, rects[i].y,
+			   rects[i].width, rects[i].height);
+	XFree(rects);
+}
+
+/* if filter is set, damage of tiles whose content is unchanged is dropped */
+static void flush_window_damage(Ghandles * g, XID window,
+				struct window_data *wd, int filter)
+{
+	if (wd->damage_fetch)
+		fetch_window_damage(g, wd);
+	if (filter && g->tile_filter && wd->tile_hashes && wd->is_mapped &&
+	    !damage_empty(&wd->damage))
+		filter_window_damage(g, window, wd);
+	if (!damage_empty(&wd->damage))
+		send_window_damage(g, window, wd);
+}
+
+/* send damage accumulated by every window since last flush; while the
+ * daemon lags behind, damage keeps being merged per window instead */
+void flush_damage(Ghandles * g)
+{
+	struct genlist *l;
+
+	if (!g->damage_pending || output_backlog_ms() > 0)
+		return;
+
+	for (l = windows_list->next; l != windows_list; l = l->next) {
+		if (l->data)
+			flush_window_damage(g, l->key, l->data, 1);
+	}
+	g->damage_pending = 0;
+	tiles_report(g);
+}
+
+static void create_window_damage(Ghandles * g, XID window,
+				 struct window_data *wd, int level)
+{
+	if (wd->damage_handle != None)
+		XDamageDestroy(g->display, wd->damage_handle);
+	wd->damage_handle = XDamageCreate(g->display, window, level);
+	wd->damage_level = level;
+	wd->damage_fetch = 0;
+}
+
+/* pick the damage reporting mode of a window from its damage event rate:
+ * raw rectangles are pushed by the X server for each drawing request, which
+ * is fine for windows updated now and then, but under heavy drawing it is
+ * cheaper to only be notified that damage exists and to fetch the merged
+ * region when flushing */
+static void update_damage_level(Ghandles * g, XID window,
+				struct window_data *wd)
+{
+	struct timespec now;
+	long elapsed_ms;
+
+	wd->damage_events++;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed_ms = (now.tv_sec - wd->damage_rate_since.tv_sec) * 1000 +
+		(now.tv_nsec - wd->damage_rate_since.tv_nsec) / 1000000;
+	if (elapsed_ms < 1000)
+		return;
+
+	if (wd->damage_level == XDamageReportRawRectangles &&
+	    wd->damage_events * 1000L > DAMAGE_NONEMPTY_RATE * elapsed_ms) {
+		DBG1("window 0x%x: %d damage events in %ldms, fetching damage\n",
+			(int)window, wd->damage_events, elapsed_ms);
+		create_window_damage(g, window, wd, XDamageReportNonEmpty);
+	} else if (wd->damage_level == XDamageReportNonEmpty &&
+		   wd->damage_events * 1000L < DAMAGE_RAW_RATE * elapsed_ms) {
+		DBG1("window 0x%x: %d damage events in %ldms, raw damage\n",
+			(int)window, wd->damage_events, elapsed_ms);
+		/* keep what was accumulated by the previous damage object */
+		if (wd->damage_fetch)
+			fetch_window_damage(g, wd);
+		create_window_damage(g, window, wd,
+				     XDamageReportRawRectangles);
+	}
+
+	wd->damage_events = 0;
+	wd->damage_rate_since = now;
+}
+
 static void send_pixmap_mfns(Ghandles * g, XID window)
 {
 	struct shm_cmd shmcmd;
+	struct gui_iov iov[3];
 	struct msg_hdr hdr;
+	struct genlist *l;
 	uint32_t *mfnbuf;
 	int ret, rcvd = 0, size;
 
+	/* pending damage refers to the previous window buffer, whose hashes
+	 * are about to be dropped */
+	l = list_lookup(windows_list, window);
+	if (l && l->data)
+		flush_window_damage(g, window, l->data, 0);
+
 	feed_xdriver(g, 'W', (int) window, 0);
 	readall(g->xserver_fd, (char *)&shmcmd, sizeof(shmcmd));
 
@@ -114,12 +259,19 @@ static void send_pixmap_mfns(Ghandles * g, XID window)
 		rcvd += ret;
 	}
 
+	if (l && l->data)
+		tiles_reset(l->data, shmcmd.width, shmcmd.height);
+
 	hdr.type = MSG_MFNDUMP;
 	hdr.window = window;
 	hdr.untrusted_len = sizeof(shmcmd) + size;
-	write_struct(g->xchan, hdr);
-	write_struct(g->xchan, shmcmd);
-	write_data(g->xchan, (char *) mfnbuf, size);
+	iov[0].base = &hdr;
+	iov[0].len = sizeof(hdr);
+	iov[1].base = &shmcmd;
+	iov[1].len = sizeof(shmcmd);
+	iov[2].base = mfnbuf;
+	iov[2].len = size;
+	write_iov(g->xchan, iov, 3);
 }
 
 static void process_xevent_createnotify(Ghandles * g, XCreateWindowEvent * ev)
@@ -161,10 +313,23 @@ static void process_xevent_createnotify(Ghandles * g, XCreateWindowEvent * ev)
 	wd->is_docked = False;
 	wd->input_hint = True;
 	wd->support_take_focus = True;
+	damage_init(&wd->damage);
+	wd->damage_handle = None;
+	wd->damage_level = XDamageReportRawRectangles;
+	wd->damage_fetch = 0;
+	wd->damage_events = 0;
+	clock_gettime(CLOCK_MONOTONIC, &wd->damage_rate_since);
+	wd->is_mapped = 0;
+	wd->depth = attr.depth;
+	wd->visual = attr.visual;
+	wd->tiles_width = 0;
+	wd->tiles_height = 0;
+	wd->tile_hashes = NULL;
+	wd->tile_state = NULL;
 	list_insert(windows_list, ev->window, wd);
 
 	if (attr.class != InputOnly)
-		XDamageCreate(g->display, ev->window,
+		create_window_damage(g, ev->window, wd,
 			XDamageReportRawRectangles);
 	// the following hopefully avoids missed damage events
 	XSync(g->display, False);
@@ -204,6 +369,7 @@ static void process_xevent_destroy(Ghandles * g, XID window)
 		if (((struct window_data*)l->data)->is_docked) {
 			XDestroyWindow(g->display, ((struct window_data*)l->data)->embeder);
 		}
+		tiles_free(l->data);
 		free(l->data);
 	}
 	list_remove(l);
@@ -277,11 +443,16 @@ static void process_xevent_map(Ghandles * g, XID window)
 	struct msg_hdr hdr;
 	struct msg_map_info map_info;
 	Window transient;
+	struct genlist *l;
 	SKIP_NONMANAGED_WINDOW;
 
 	if (g->log_level > 1)
 		fprintf(stderr, "MAP for window 0x%x\n", (int)window);
 
+	l = list_lookup(windows_list, window);
+	if (l->data)
+		((struct window_data *)l->data)->is_mapped = 1;
+
 	send_pixmap_mfns(g, window);
 	send_window_state(g, window);
 	XGetWindowAttributes(g->display, window, &attr);
@@ -300,10 +471,15 @@ static void process_xevent_map(Ghandles * g, XID window)
 static void process_xevent_unmap(Ghandles * g, XID window)
 {
 	struct msg_hdr hdr;
+	struct genlist *l;
 	SKIP_NONMANAGED_WINDOW;
 
 	if (g->log_level > 1)
 		fprintf(stderr, "UNMAP for window 0x%x\n", (int)window);
+	/* XShmGetImage fails on unmapped windows */
+	l = list_lookup(windows_list, window);
+	if (l->data)
+		((struct window_data *)l->data)->is_mapped = 0;
 	hdr.type = MSG_UNMAP;
 	hdr.window = window;
 	hdr.untrusted_len = 0;
@@ -413,6 +589,11 @@ static void process_xevent_selection(Ghandles * g, XSelectionEvent * ev)
 			   &bytes_left, &data);
 	if (bytes_left <= 0)
 		return;
+	if (type == XInternAtom(g->display, "INCR", False)) {
+		XFree(data);
+		start_incr_recv(g, ev->requestor, Qprop);
+		return;
+	}
 	result =
 	    XGetWindowProperty(g->display, ev->requestor, Qprop, 0,
 			       bytes_left, 0,
@@ -476,8 +657,9 @@ static void process_xevent_selection_req(Ghandles * g,
 		Xutf8TextListToTextProperty(g->display,
 					    (char **) &g->clipboard_data,
 					    1, convert_style, &ct);
-		XSetTextProperty(g->display, req->requestor, &ct,
-				 req->property);
+		if (!start_incr_send(g, req, &ct))
+			XSetTextProperty(g->display, req->requestor, &ct,
+					 req->property);
 		XFree(ct.value);
 		resp.property = req->property;
 	}
@@ -798,20 +980,29 @@ static void process_xevent_message(Ghandles * g, XClientMessageEvent * ev)
 		process_xevent_message_wm_state(g, ev);
 }
 
-static void process_xevent_damage(Ghandles * g, XID window,
-			   int x, int y, int width, int height)
+/* damaged rectangles are accumulated per window and sent by flush_damage */
+static void process_xevent_damage(Ghandles * g, const XDamageNotifyEvent * ev)
 {
-	struct msg_shmimage mx;
-	struct msg_hdr hdr;
-	SKIP_NONMANAGED_WINDOW;
+	struct window_data *wd;
+	struct genlist *l;
 
-	hdr.type = MSG_SHMIMAGE;
-	hdr.window = window;
-	mx.x = x;
-	mx.y = y;
-	mx.width = width;
-	mx.height = height;
-	write_message(g->xchan, hdr, mx);
+	if (!(l = list_lookup(windows_list, ev->drawable)) || !l->data)
+		return;
+	wd = l->data;
+
+	/* events of a previous damage object may still be queued, hence
+	 * the level of the event is checked rather than the window's */
+	if (ev->level == XDamageReportNonEmpty)
+		wd->damage_fetch = 1;
+	else
+		damage_add(&wd->damage, ev->area.x, ev->area.y,
+			   ev->area.width, ev->area.height);
+	if (!g->damage_pending) {
+		g->damage_pending = 1;
+		clock_gettime(CLOCK_MONOTONIC, &g->damage_since);
+	}
+
+	update_damage_level(g, ev->drawable, wd);
 }
 
 void process_xevent(Ghandles * g)
@@ -852,6 +1043,8 @@ void process_xevent(Ghandles * g)
 					     event_buffer);
 		break;
 	case PropertyNotify:
+		if (process_clipboard_property(g, &event_buffer.xproperty))
+			break;
 		process_xevent_property(g, event_buffer.xproperty.window,
 					(XPropertyEvent *) & event_buffer);
 		break;
@@ -865,12 +1058,7 @@ void process_xevent(Ghandles * g)
 			dev = (XDamageNotifyEvent *) & event_buffer;
 //      fprintf(stderr, "x=%hd y=%hd gx=%hd gy=%hd w=%hd h=%hd\n",
 //        dev->area.x, dev->area.y, dev->geometry.x, dev->geometry.y, dev->area.width, dev->area.height); 
-			process_xevent_damage(g, dev->drawable,
-					      dev->area.x,
-					      dev->area.y,
-					      dev->area.width,
-					      dev->area.height);
-//                      fprintf(stderr, "@");
+			process_xevent_damage(g, dev);
 		} else {
 			DBG1("#");
 		}
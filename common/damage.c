@@ -0,0 +1,92 @@
+#include "damage.h"
+
+#define min(x, y)	((x) < (y) ? (x) : (y))
+#define max(x, y)	((x) > (y) ? (x) : (y))
+
+
+static long rect_area(const struct damage_rect *r)
+{
+	return (long)r->width * r->height;
+}
+
+static void rect_union(struct damage_rect *dst, const struct damage_rect *a,
+		       const struct damage_rect *b)
+{
+	int x1, y1, x2, y2;
+
+	x1 = min(a->x, b->x);
+	y1 = min(a->y, b->y);
+	x2 = max(a->x + a->width, b->x + b->width);
+	y2 = max(a->y + a->height, b->y + b->height);
+
+	dst->x = x1;
+	dst->y = y1;
+	dst->width = x2 - x1;
+	dst->height = y2 - y1;
+}
+
+/* return 1 if a and b overlap or are at most DAMAGE_MERGE_GAP pixels apart */
+static int rect_near(const struct damage_rect *a, const struct damage_rect *b)
+{
+	return a->x <= b->x + b->width + DAMAGE_MERGE_GAP &&
+		b->x <= a->x + a->width + DAMAGE_MERGE_GAP &&
+		a->y <= b->y + b->height + DAMAGE_MERGE_GAP &&
+		b->y <= a->y + a->height + DAMAGE_MERGE_GAP;
+}
+
+static void remove_rect(struct damage_region *region, int i)
+{
+	region->rects[i] = region->rects[--region->count];
+}
+
+void damage_add(struct damage_region *region, int x, int y, int width,
+		int height)
+{
+	struct damage_rect r, u;
+	long growth, best_growth;
+	int i, best;
+
+	if (width <= 0 || height <= 0)
+		return;
+
+	r.x = x;
+	r.y = y;
+	r.width = width;
+	r.height = height;
+
+	/* absorb every rectangle close enough to the new one; the union may
+	 * reach rectangles which were not near the original, hence the
+	 * restart */
+again:
+	for (i = 0; i < region->count; i++) {
+		if (rect_near(&region->rects[i], &r)) {
+			rect_union(&r, &region->rects[i], &r);
+			remove_rect(region, i);
+			goto again;
+		}
+	}
+
+	if (region->count < MAX_DAMAGE_RECTS) {
+		region->rects[region->count++] = r;
+		return;
+	}
+
+	/* region is full: merge with the rectangle whose union adds the
+	 * smallest area */
+	best = 0;
+	best_growth = -1;
+	for (i = 0; i < region->count; i++) {
+		rect_union(&u, &region->rects[i], &r);
+		growth = rect_area(&u) - rect_area(&region->rects[i]);
+		if (best_growth == -1 || growth < best_growth) {
+			best = i;
+			best_growth = growth;
+		}
+	}
+
+	rect_union(&r, &region->rects[best], &r);
+	remove_rect(region, best);
+	goto again;
+}
+
+// vim: noet:ts=8:
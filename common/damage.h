@@ -0,0 +1,40 @@
+#ifndef _DAMAGE_H
+#define _DAMAGE_H 1
+
+/* Bounded set of damaged rectangles. Overlapping or nearby rectangles are
+ * merged when added, and once the set is full the new rectangle is merged
+ * into the one which grows the least, so a region never holds more than
+ * MAX_DAMAGE_RECTS entries whatever the number of rectangles added. */
+
+#define MAX_DAMAGE_RECTS	16
+/* rectangles separated by at most this number of pixels are merged */
+#define DAMAGE_MERGE_GAP	8
+
+struct damage_rect {
+	int x;
+	int y;
+	int width;
+	int height;
+};
+
+struct damage_region {
+	int count;
+	struct damage_rect rects[MAX_DAMAGE_RECTS];
+};
+
+static inline void damage_init(struct damage_region *region)
+{
+	region->count = 0;
+}
+
+static inline int damage_empty(const struct damage_region *region)
+{
+	return region->count == 0;
+}
+
+void damage_add(struct damage_region *region, int x, int y, int width,
+		int height);
+
+#endif /* _DAMAGE_H */
+
+// vim: noet:ts=8:
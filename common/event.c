@@ -0,0 +1,336 @@
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "event.h"
+
+#define QUEUE_STATS_INTERVAL_US	10000000
+
+
+int event_loop_init(struct event_loop *loop)
+{
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd == -1) {
+		warn("epoll_create1");
+		return -1;
+	}
+	loop->count = 0;
+	return 0;
+}
+
+static struct event_source *add_source(struct event_loop *loop, int fd,
+				       int timer, int edge,
+				       event_handler handle, void *arg)
+{
+	struct event_source *src;
+	struct epoll_event ev;
+
+	if (loop->count == MAX_EVENT_SOURCES) {
+		warnx("too many event sources");
+		return NULL;
+	}
+
+	src = &loop->sources[loop->count];
+	src->fd = fd;
+	src->timer = timer;
+	src->armed = 0;
+	src->expired = 0;
+	src->handle = handle;
+	src->arg = arg;
+
+	ev.events = EPOLLIN;
+	if (edge)
+		ev.events |= EPOLLET;
+	ev.data.ptr = src;
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		warn("epoll_ctl");
+		return NULL;
+	}
+
+	loop->count++;
+	return src;
+}
+
+/* watch fd for input
+ * with edge set, the source is only ready when new input arrives: handle
+ * must consume it, or at least not expect to be called again for it */
+struct event_source *event_add_fd(struct event_loop *loop, int fd, int edge,
+				  event_handler handle, void *arg)
+{
+	return add_source(loop, fd, 0, edge, handle, arg);
+}
+
+/* add a timer, disarmed */
+struct event_source *event_add_timer(struct event_loop *loop,
+				     event_handler handle, void *arg)
+{
+	struct event_source *src;
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd == -1) {
+		warn("timerfd_create");
+		return NULL;
+	}
+
+	src = add_source(loop, fd, 1, 0, handle, arg);
+	if (src == NULL)
+		close(fd);
+	return src;
+}
+
+/* expire timer once, in ms milliseconds; 0 means on next wakeup
+ * a timer already armed is rearmed */
+void event_arm_timer(struct event_source *timer, int ms)
+{
+	struct itimerspec its;
+
+	its.it_interval.tv_sec = 0;
+	its.it_interval.tv_nsec = 0;
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+	/* a zero value would disarm the timer */
+	if (ms == 0)
+		its.it_value.tv_nsec = 1;
+	if (timerfd_settime(timer->fd, 0, &its, NULL) == -1)
+		err(1, "timerfd_settime");
+	timer->armed = 1;
+}
+
+void event_disarm_timer(struct event_source *timer)
+{
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+	if (!timer->armed)
+		return;
+	if (timerfd_settime(timer->fd, 0, &its, NULL) == -1)
+		err(1, "timerfd_settime");
+	timer->armed = 0;
+}
+
+/* sleep until some source is ready, at most timeout ms (-1: no limit), and
+ * call the handlers of ready descriptors
+ * return -1 on error or if a handler stops the loop */
+int event_wait(struct event_loop *loop, int timeout)
+{
+	struct epoll_event events[MAX_EVENT_SOURCES];
+	struct event_source *src;
+	uint64_t expirations;
+	int i, n;
+
+	n = epoll_wait(loop->epoll_fd, events, MAX_EVENT_SOURCES, timeout);
+	if (n == -1) {
+		if (errno == EINTR)
+			return 0;
+		warn("epoll_wait");
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		src = events[i].data.ptr;
+		if (src->timer) {
+			/* a timer rearmed since its expiration reads nothing */
+			if (read(src->fd, &expirations, sizeof(expirations)) !=
+			    sizeof(expirations))
+				continue;
+			src->armed = 0;
+			src->expired = 1;
+		} else if (src->handle != NULL && src->handle(src) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* call the handlers of timers expired since last call, in the order they
+ * were added
+ * return -1 if a handler stops the loop */
+int event_run_timers(struct event_loop *loop)
+{
+	struct event_source *src;
+	int i;
+
+	for (i = 0; i < loop->count; i++) {
+		src = &loop->sources[i];
+		if (!src->expired)
+			continue;
+		src->expired = 0;
+		if (src->handle != NULL && src->handle(src) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sample_depth(struct event_queue *q, unsigned long depth)
+{
+	q->depth_sum += depth;
+	q->depth_samples++;
+	if (depth > q->depth_max)
+		q->depth_max = depth;
+}
+
+/* run one round of q: items are run by batches until the queue is empty
+ * or its budget is spent
+ * return the number of items run */
+static unsigned int run_queue(struct event_queue *q)
+{
+	unsigned int n, max, done;
+	uint64_t start, wait;
+	int empty;
+
+	start = now_us();
+	if (q->depth != NULL) {
+		n = q->depth(q->arg);
+		if (n == 0) {
+			/* the previous round may have emptied the queue
+			 * exactly on its budget */
+			q->backlog = 0;
+			q->ready_us = start;
+			return 0;
+		}
+		sample_depth(q, n);
+	}
+
+	n = 0;
+	empty = 0;
+	while (n < q->budget) {
+		max = q->budget - n;
+		if (q->budget_us && max > EVENT_QUEUE_BATCH)
+			max = EVENT_QUEUE_BATCH;
+		done = q->run(q->arg, max);
+		n += done;
+		if (done < max) {
+			empty = 1;
+			break;
+		}
+		if (q->budget_us && now_us() - start >= (uint64_t)q->budget_us)
+			break;
+	}
+
+	/* without a depth function, the depth at wakeup is only known once
+	 * the queue is drained */
+	q->backlog += n;
+	if (empty) {
+		if (q->depth == NULL && q->backlog > 0)
+			sample_depth(q, q->backlog);
+		q->backlog = 0;
+	}
+
+	if (n > 0) {
+		wait = start - q->ready_us;
+		q->wait_us_sum += wait;
+		if (wait > q->wait_us_max)
+			q->wait_us_max = wait;
+		q->items += n;
+		q->rounds++;
+		if (!empty)
+			q->cut++;
+	}
+	q->ready_us = now_us();
+	return n;
+}
+
+/* run the queues in rounds, input-class queues first in each round, until
+ * none of them has anything left to do or EVENT_SCHEDULE_ROUNDS rounds ran
+ * return non-zero if items were left for the next pass, which should then
+ * not wait for new input */
+int event_schedule(struct event_queue *queues, int count)
+{
+	struct event_queue *q;
+	unsigned int n, rounds;
+	uint64_t wakeup;
+	int i, input, left;
+
+	/* a queue left with items by the previous pass has been waiting
+	 * since its last round */
+	wakeup = now_us();
+	for (i = 0; i < count; i++) {
+		if (queues[i].backlog == 0)
+			queues[i].ready_us = wakeup;
+	}
+
+	rounds = 0;
+	do {
+		n = 0;
+		for (input = 1; input >= 0; input--) {
+			for (i = 0; i < count; i++) {
+				if (!queues[i].input == !input)
+					n += run_queue(&queues[i]);
+			}
+		}
+	} while (n > 0 && ++rounds < EVENT_SCHEDULE_ROUNDS);
+
+	/* a queue whose last round was cut by its budget may have items
+	 * left */
+	left = 0;
+	for (i = 0; i < count; i++) {
+		q = &queues[i];
+		if (q->backlog > 0) {
+			q->deferred++;
+			left = 1;
+		}
+	}
+	return left;
+}
+
+/* log items run per second, and depth and wait of each queue, every
+ * QUEUE_STATS_INTERVAL_US */
+void event_report_queues(struct event_queue *queues, int count)
+{
+	struct event_queue *q;
+	uint64_t now, elapsed;
+	int i;
+
+	now = now_us();
+	for (i = 0; i < count; i++) {
+		q = &queues[i];
+		if (q->stats_since_us == 0) {
+			q->stats_since_us = now;
+			continue;
+		}
+		elapsed = now - q->stats_since_us;
+		if (elapsed < QUEUE_STATS_INTERVAL_US)
+			continue;
+
+		fprintf(stderr, "%s: %llu items/s, %.1f per round, %lu rounds"
+			" cut, %lu passes cut, depth %.1f (max %lu),"
+			" wait %lluus (max %lluus)\n",
+			q->name,
+			(unsigned long long)(q->items * 1000000ULL / elapsed),
+			q->rounds ? (double)q->items / q->rounds : 0,
+			q->cut, q->deferred,
+			q->depth_samples ?
+				(double)q->depth_sum / q->depth_samples : 0,
+			q->depth_max,
+			(unsigned long long)(q->rounds ?
+				q->wait_us_sum / q->rounds : 0),
+			(unsigned long long)q->wait_us_max);
+
+		q->items = 0;
+		q->rounds = 0;
+		q->cut = 0;
+		q->deferred = 0;
+		q->depth_sum = 0;
+		q->depth_max = 0;
+		q->depth_samples = 0;
+		q->wait_us_sum = 0;
+		q->wait_us_max = 0;
+		q->stats_since_us = now;
+	}
+}
+
+// vim: noet:ts=8:
@@ -0,0 +1,86 @@
+#ifndef _EVENT_H
+#define _EVENT_H 1
+
+#include <stdint.h>
+
+/* Event loop of the daemon and the agent, on top of epoll.
+ *
+ * A source is either a file descriptor watched for input or a timer (a
+ * timerfd owned by the loop). event_wait() sleeps until some source is
+ * ready, calls the handlers of ready descriptors at once, and leaves
+ * expired timers to event_run_timers(), so that timers run after the
+ * batch of work of their wakeup. */
+
+#define MAX_EVENT_SOURCES	8
+/* items run between two checks of the time budget of a queue */
+#define EVENT_QUEUE_BATCH	8
+/* rounds run by event_schedule() before timers and output get a turn */
+#define EVENT_SCHEDULE_ROUNDS	4
+
+struct event_source;
+
+/* return non-zero to stop the loop */
+typedef int (*event_handler)(struct event_source *src);
+
+struct event_source {
+	int fd;
+	int timer;		/* fd is a timerfd owned by the loop */
+	int armed;		/* timer: will expire */
+	int expired;		/* timer: expired, handler not run yet */
+	event_handler handle;	/* may be NULL: the source only wakes up */
+	void *arg;
+};
+
+struct event_loop {
+	int epoll_fd;
+	int count;
+	struct event_source sources[MAX_EVENT_SOURCES];
+};
+
+/* Source of work of a pass of the main loop, such as X events or received
+ * messages. event_schedule() runs queues in rounds, each queue handling at
+ * most its budget of items per round, so a flood from one source only
+ * delays the others by one budget. A pass runs at most
+ * EVENT_SCHEDULE_ROUNDS rounds, so a flood doesn't delay timers and the
+ * flush of output either: what is left waits for the next pass. */
+struct event_queue {
+	const char *name;
+	/* handle at most max items, return the number handled */
+	unsigned int (*run)(void *arg, unsigned int max);
+	/* number of items queued, NULL if not known before running */
+	unsigned int (*depth)(void *arg);
+	void *arg;
+	int input;		/* input-class: served first in each round */
+	unsigned int budget;	/* items per round */
+	long budget_us;		/* time per round, 0 for no limit */
+	/* state */
+	uint64_t ready_us;	/* end of last round, or wakeup */
+	unsigned long backlog;	/* items run since the queue was empty */
+	/* counters, see event_report_queues() */
+	unsigned long items;
+	unsigned long rounds;	/* rounds which ran items */
+	unsigned long cut;	/* rounds ended by the budget */
+	unsigned long deferred;	/* passes ended with items left */
+	unsigned long depth_sum;
+	unsigned long depth_max;
+	unsigned long depth_samples;
+	uint64_t wait_us_sum;	/* wait of queued items for their round */
+	uint64_t wait_us_max;
+	uint64_t stats_since_us;
+};
+
+int event_loop_init(struct event_loop *loop);
+struct event_source *event_add_fd(struct event_loop *loop, int fd, int edge,
+				  event_handler handle, void *arg);
+struct event_source *event_add_timer(struct event_loop *loop,
+				     event_handler handle, void *arg);
+void event_arm_timer(struct event_source *timer, int ms);
+void event_disarm_timer(struct event_source *timer);
+int event_wait(struct event_loop *loop, int timeout);
+int event_run_timers(struct event_loop *loop);
+int event_schedule(struct event_queue *queues, int count);
+void event_report_queues(struct event_queue *queues, int count);
+
+#endif /* _EVENT_H */
+
+// vim: noet:ts=8:
@@ -0,0 +1,114 @@
+/*
+ * Tests of event_schedule() with fake queues: a flood is cut after
+ * EVENT_SCHEDULE_ROUNDS rounds, and a queue emptied exactly on its budget
+ * isn't reported as having items left.
+ *
+ * Usage: eventtest
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "event.h"
+
+#define BUDGET		16
+
+struct fake {
+	unsigned int queued;
+	unsigned int run;
+};
+
+static unsigned int fake_run(void *arg, unsigned int max)
+{
+	struct fake *f = arg;
+	unsigned int n;
+
+	n = (f->queued < max) ? f->queued : max;
+	f->queued -= n;
+	f->run += n;
+	return n;
+}
+
+static unsigned int fake_depth(void *arg)
+{
+	struct fake *f = arg;
+
+	return f->queued;
+}
+
+static void init_queue(struct event_queue *q, struct fake *f, int depth,
+		       unsigned int queued)
+{
+	memset(q, 0, sizeof(*q));
+	memset(f, 0, sizeof(*f));
+	q->name = "fake";
+	q->run = fake_run;
+	q->depth = depth ? fake_depth : NULL;
+	q->arg = f;
+	q->budget = BUDGET;
+	f->queued = queued;
+}
+
+/* the queue is emptied by a round which spends its whole budget: the next
+ * round finds it empty, and the pass must not report items left */
+static void test_exact_budget(int depth)
+{
+	struct event_queue q;
+	struct fake f;
+	int left;
+
+	init_queue(&q, &f, depth, 2 * BUDGET);
+	left = event_schedule(&q, 1);
+	if (left || f.queued != 0 || f.run != 2 * BUDGET)
+		errx(1, "exact budget, depth %d: left %d, %u run, %u queued",
+		     depth, left, f.run, f.queued);
+	if (q.backlog != 0)
+		errx(1, "exact budget, depth %d: backlog %lu", depth,
+		     q.backlog);
+
+	/* nothing new: a pass runs nothing and leaves nothing */
+	left = event_schedule(&q, 1);
+	if (left || f.run != 2 * BUDGET)
+		errx(1, "idle pass, depth %d: left %d, %u run", depth, left,
+		     f.run);
+}
+
+/* a flood is cut after EVENT_SCHEDULE_ROUNDS rounds, and the rest runs on
+ * the following passes */
+static void test_flood(int depth)
+{
+	struct event_queue q;
+	struct fake f;
+	unsigned int queued;
+	int left, passes;
+
+	/* the third pass ends with a round that isn't full */
+	queued = 3 * EVENT_SCHEDULE_ROUNDS * BUDGET - BUDGET / 2;
+	init_queue(&q, &f, depth, queued);
+	left = event_schedule(&q, 1);
+	if (!left || f.run != EVENT_SCHEDULE_ROUNDS * BUDGET)
+		errx(1, "flood, depth %d: left %d, %u run", depth, left, f.run);
+	if (q.deferred != 1)
+		errx(1, "flood, depth %d: %lu passes cut", depth, q.deferred);
+
+	for (passes = 1; left && passes < 10; passes++)
+		left = event_schedule(&q, 1);
+	if (left || f.run != queued || passes != 3)
+		errx(1, "flood, depth %d: left %d, %u run in %d passes",
+		     depth, left, f.run, passes);
+}
+
+int main(void)
+{
+	int depth;
+
+	for (depth = 0; depth <= 1; depth++) {
+		test_exact_budget(depth);
+		test_flood(depth);
+	}
+	printf("event_schedule: ok\n");
+	return 0;
+}
+
+// vim: noet:ts=8:
@@ -25,6 +25,8 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <X11/Xlib.h>
 #include <X11/Xlibint.h>
 
@@ -32,6 +34,43 @@
 #include "qubes-gui-protocol.h"
 #include "xchan.h"
 
+/* corked output is sent once it reaches this size, or this age when a
+ * message is added to it */
+#define CORK_MAX_BYTES		(64 * 1024)
+#define CORK_MAX_DELAY_MS	2
+#define OUTPUT_STATS_INTERVAL_MS	10000
+/* a send blocked this long means the peer doesn't keep up */
+#define SEND_STALL_MS		10
+
+/* messages are assembled here before being sent; while the output is
+ * corked, several messages accumulate. The buffer grows up to the largest
+ * batch sent.
+ * Messages are sent in the order they were written, with no separate lane
+ * for input: input goes from the daemon to the agent, and window content
+ * (MFNDUMP, damage) from the agent to the daemon, in the other ring. */
+static struct {
+	struct xchan *corked;	/* NULL if messages are sent right away */
+	char *buf;
+	size_t size;
+	size_t len;
+	struct timespec since;	/* time of the first buffered message */
+	unsigned long messages;	/* since stats_since */
+	unsigned long sends;
+	unsigned long stalls;
+	struct timespec stats_since;
+	struct timespec stall_end;	/* end of the last stalled send */
+	long stall_ms;		/* its duration */
+} out;
+
+/* payloads of the message being handled are received here and parsed in
+ * place, rather than in stack buffers. It is allocated once with the size
+ * of the largest message (MSG_MFNDUMP). */
+#define RECV_BUF_SIZE		(4096 * SHM_CMD_NUM_PAGES)
+
+static struct {
+	char *buf;
+	size_t len;
+} in;
 
 int read_data(struct xchan *xchan, char *buf, int size)
 {
@@ -47,21 +86,273 @@ int read_data(struct xchan *xchan, char *buf, int size)
 	return size;
 }
 
-void write_data(struct xchan *xchan, char *buf, int size)
+/* receive the next size bytes of the current message and return a pointer
+ * to them; it remains valid until release_views() is called. The data is
+ * untrusted and must be validated in place or copied before use. */
+void *read_view(struct xchan *xchan, size_t size)
+{
+	char *p;
+
+	if (!in.buf) {
+		in.buf = malloc(RECV_BUF_SIZE);
+		if (!in.buf) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (size > RECV_BUF_SIZE - in.len) {
+		fprintf(stderr, "message too large (%zu bytes)\n", in.len + size);
+		exit(EXIT_FAILURE);
+	}
+
+	p = in.buf + in.len;
+	read_data(xchan, p, size);
+	in.len += size;
+	return p;
+}
+
+/* start a new message, invalidating every view of the previous one */
+void release_views(void)
+{
+	in.len = 0;
+}
+
+static long elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void send_output(struct xchan *xchan, const void *buf, size_t size)
 {
+	struct timespec start;
+	long blocked;
 	err_t error;
 
-	error = xchan_sendall(xchan, buf, size); // this may block
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	error = xchan_sendall(xchan, (void *)buf, size); // this may block
 	if (error) {
 		print_error(error, "failed to write data");
 		exit(EXIT_FAILURE);
 	}
+	out.sends++;
+
+	blocked = elapsed_ms(&start);
+	if (blocked >= SEND_STALL_MS) {
+		clock_gettime(CLOCK_MONOTONIC, &out.stall_end);
+		out.stall_ms = blocked;
+		out.stalls++;
+	}
+}
+
+/* xchan_sendall() can't tell whether it would block: once a send has
+ * waited for the peer to make room, the peer is given as long again to
+ * drain the ring, during which deferrable output should be held back.
+ * Only the agent has some (damage); the daemon sends input and window
+ * state, which the agent must get in order, so it still blocks on a stalled
+ * agent.
+ * return the time left in ms, 0 if output may be sent */
+int output_backlog_ms(void)
+{
+	long left;
+
+	if (out.stall_ms == 0)
+		return 0;
+	left = out.stall_ms - elapsed_ms(&out.stall_end);
+	if (left <= 0) {
+		out.stall_ms = 0;
+		return 0;
+	}
+	return left;
+}
+
+/* send buffered messages, if any */
+static void drain_output(struct xchan *xchan)
+{
+	if (out.len == 0)
+		return;
+	send_output(xchan, out.buf, out.len);
+	out.len = 0;
+}
+
+/* send a message made of several fragments (header, payload, variable
+ * arrays) with a single xchan_sendall, hence a single notification of the
+ * other side instead of one per fragment; if output is corked, the message
+ * waits for the end of the batch */
+void write_iov(struct xchan *xchan, const struct gui_iov *iov, int count)
+{
+	size_t size;
+	char *p;
+	int i;
+
+	/* messages of an other connection must not be delayed */
+	if (out.corked && out.corked != xchan)
+		drain_output(out.corked);
+
+	size = 0;
+	for (i = 0; i < count; i++)
+		size += iov[i].len;
+
+	out.messages++;
+	if (!out.corked && count == 1) {
+		send_output(xchan, iov[0].base, size);
+		return;
+	}
+
+	if (out.len + size > out.size) {
+		p = realloc(out.buf, out.len + size);
+		if (!p) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		out.buf = p;
+		out.size = out.len + size;
+	}
+
+	if (out.len == 0)
+		clock_gettime(CLOCK_MONOTONIC, &out.since);
+	for (i = 0; i < count; i++) {
+		memcpy(out.buf + out.len, iov[i].base, iov[i].len);
+		out.len += iov[i].len;
+	}
+
+	if (out.corked != xchan || out.len >= CORK_MAX_BYTES ||
+	    elapsed_ms(&out.since) >= CORK_MAX_DELAY_MS)
+		drain_output(xchan);
+}
+
+void write_data(struct xchan *xchan, char *buf, int size)
+{
+	struct gui_iov iov;
+
+	iov.base = buf;
+	iov.len = size;
+	write_iov(xchan, &iov, 1);
+}
+
+/* buffer messages written to xchan until flush_output() */
+void cork_output(struct xchan *xchan)
+{
+	if (out.corked && out.corked != xchan)
+		drain_output(out.corked);
+	out.corked = xchan;
+}
+
+/* send messages buffered since cork_output() at once and stop buffering */
+void flush_output(struct xchan *xchan)
+{
+	drain_output(xchan);
+	out.corked = NULL;
+}
+
+/* send messages buffered so far, keep buffering the next ones */
+void push_output(struct xchan *xchan)
+{
+	if (out.corked == xchan)
+		drain_output(xchan);
+}
+
+/* log messages and notifications sent per second, every
+ * OUTPUT_STATS_INTERVAL_MS */
+void report_output_stats(void)
+{
+	long elapsed;
+
+	if (out.stats_since.tv_sec == 0 && out.stats_since.tv_nsec == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &out.stats_since);
+		return;
+	}
+	elapsed = elapsed_ms(&out.stats_since);
+	if (elapsed < OUTPUT_STATS_INTERVAL_MS)
+		return;
+
+	fprintf(stderr, "xchan output: %lu messages/s in %lu notifications/s,"
+		" %lu stalls\n",
+		out.messages * 1000 / elapsed, out.sends * 1000 / elapsed,
+		out.stalls);
+	out.messages = 0;
+	out.sends = 0;
+	out.stalls = 0;
+	clock_gettime(CLOCK_MONOTONIC, &out.stats_since);
+}
+
+#define MESSAGE_NAME(x)	[x] = #x
+
+static const char *const message_names[MSG_MAX] = {
+	MESSAGE_NAME(MSG_KEYPRESS),
+	MESSAGE_NAME(MSG_BUTTON),
+	MESSAGE_NAME(MSG_MOTION),
+	MESSAGE_NAME(MSG_CROSSING),
+	MESSAGE_NAME(MSG_FOCUS),
+	MESSAGE_NAME(MSG_RESIZE),
+	MESSAGE_NAME(MSG_CREATE),
+	MESSAGE_NAME(MSG_DESTROY),
+	MESSAGE_NAME(MSG_MAP),
+	MESSAGE_NAME(MSG_UNMAP),
+	MESSAGE_NAME(MSG_CONFIGURE),
+	MESSAGE_NAME(MSG_MFNDUMP),
+	MESSAGE_NAME(MSG_SHMIMAGE),
+	MESSAGE_NAME(MSG_CLOSE),
+	MESSAGE_NAME(MSG_EXECUTE),
+	MESSAGE_NAME(MSG_CLIPBOARD_REQ),
+	MESSAGE_NAME(MSG_CLIPBOARD_DATA),
+	MESSAGE_NAME(MSG_WMNAME),
+	MESSAGE_NAME(MSG_KEYMAP_NOTIFY),
+	MESSAGE_NAME(MSG_DOCK),
+	MESSAGE_NAME(MSG_WINDOW_HINTS),
+	MESSAGE_NAME(MSG_WINDOW_FLAGS),
+	MESSAGE_NAME(MSG_SHMIMAGE_BATCH),
+	MESSAGE_NAME(MSG_CAPABILITIES),
+};
+
+const char *message_name(uint32_t type)
+{
+	if (type <= MSG_MIN || type >= MSG_MAX || !message_names[type])
+		return "unknown";
+	return message_names[type];
+}
+
+/* log messages received per second and per receive pass, by type, every
+ * OUTPUT_STATS_INTERVAL_MS */
+void report_message_stats(struct message_stats *stats)
+{
+	long elapsed;
+	int i;
+
+	if (stats->since.tv_sec == 0 && stats->since.tv_nsec == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &stats->since);
+		return;
+	}
+	elapsed = elapsed_ms(&stats->since);
+	if (elapsed < OUTPUT_STATS_INTERVAL_MS)
+		return;
+
+	fprintf(stderr, "xchan input: %lu messages/s, %.1f per pass\n",
+		stats->messages * 1000 / elapsed,
+		stats->wakeups ? (double)stats->messages / stats->wakeups : 0);
+	for (i = 0; i < MSG_MAX - MSG_MIN; i++) {
+		if (stats->count[i])
+			fprintf(stderr, "    %-20s %lu/s\n",
+				message_name(MSG_MIN + i),
+				stats->count[i] * 1000 / elapsed);
+	}
+	memset(stats, 0, sizeof(*stats));
+	clock_gettime(CLOCK_MONOTONIC, &stats->since);
 }
 
 int real_write_message(struct xchan *xchan, char *hdr, int size, char *data, int datasize)
 {
-	write_data(xchan, hdr, size);
-	write_data(xchan, data, datasize);
+	struct gui_iov iov[2];
+
+	iov[0].base = hdr;
+	iov[0].len = size;
+	iov[1].base = data;
+	iov[1].len = datasize;
+	write_iov(xchan, iov, 2);
 	return 0;
 }
 
@@ -1,10 +1,14 @@
 #ifndef _GUI_COMMON_H
 #define _GUI_COMMON_H 1
 
+#include <stddef.h>
 #include <stdint.h>
+#include <time.h>
 
 #include <X11/Xlib.h>
 
+#include "qubes-gui-protocol.h"
+
 #ifdef __GNUC__
 #  define UNUSED(x) UNUSED_ ## x __attribute__((__unused__))
 #else
@@ -34,9 +38,33 @@
 
 struct xchan;
 
+/* fragment of a message given to write_iov() */
+struct gui_iov {
+	const void *base;
+	size_t len;
+};
+
+/* counters of a message dispatcher, see report_message_stats() */
+struct message_stats {
+	unsigned long count[MSG_MAX - MSG_MIN];
+	unsigned long messages;
+	unsigned long wakeups;	/* receive passes which got messages */
+	struct timespec since;
+};
+
 void write_data(struct xchan *xchan, char *buf, int size);
+void write_iov(struct xchan *xchan, const struct gui_iov *iov, int count);
+void cork_output(struct xchan *xchan);
+void flush_output(struct xchan *xchan);
+void push_output(struct xchan *xchan);
+void report_output_stats(void);
+int output_backlog_ms(void);
+const char *message_name(uint32_t type);
+void report_message_stats(struct message_stats *stats);
 int real_write_message(struct xchan *xchan, char *hdr, int size, char *data, int datasize);
 int read_data(struct xchan *xchan, char *buf, int size);
+void *read_view(struct xchan *xchan, size_t size);
+void release_views(void);
 int dummy_handler(Display * dpy, XErrorEvent * ev);
 
 int send_keymap(struct xchan *xchan, Display *display);
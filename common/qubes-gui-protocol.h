@@ -78,6 +78,8 @@ enum {
 	MSG_DOCK, // 143
 	MSG_WINDOW_HINTS,
 	MSG_WINDOW_FLAGS,
+	MSG_SHMIMAGE_BATCH,
+	MSG_CAPABILITIES,
 	MSG_MAX
 };
 /* VM -> Dom0, Dom0 -> VM */
@@ -148,6 +150,14 @@ struct msg_shmimage {
 	uint32_t width;
 	uint32_t height;
 };
+/* VM -> Dom0
+ * only the first count rectangles are sent, untrusted_len is
+ * sizeof(count) + count * sizeof(struct msg_shmimage) */
+#define MAX_SHMIMAGE_BATCH	16
+struct msg_shmimage_batch {
+	uint32_t count;
+	struct msg_shmimage rects[MAX_SHMIMAGE_BATCH];
+};
 
 /* Dom0 -> VM */
 struct msg_focus {
@@ -195,6 +205,15 @@ struct msg_window_flags {
 #define WINDOW_FLAG_DEMANDS_ATTENTION	(1<<1)
 #define WINDOW_FLAG_MINIMIZE			(1<<2)
 
+/* Dom0 -> VM, VM -> Dom0
+ * sent by the daemon after the keymap, agents which know it answer with
+ * their own. A feature is used only if both sides have its bit set, so
+ * older peers, which ignore or never send this message, get none. */
+struct msg_capabilities {
+	uint32_t features;
+};
+#define CAP_SHMIMAGE_BATCH		(1<<0)	/* MSG_SHMIMAGE_BATCH */
+
 /* VM -> Dom0 */
 struct shm_cmd {
 	unsigned int capsule_id;
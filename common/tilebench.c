@@ -0,0 +1,175 @@
+/*
+ * Microbenchmark of tile kernels: hash and compare a window buffer tile by
+ * tile, and compute its transparency mask row by row, with each kernel
+ * supported by the CPU, and report throughput.
+ *
+ * Usage: tilebench [width height [iterations]]
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "qubes-gui-protocol.h"
+#include "tilehash.h"
+
+#define DEFAULT_WIDTH		3840
+#define DEFAULT_HEIGHT		2160
+#define DEFAULT_ITERATIONS	20
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t hash_buffer(const struct tile_kernel *k,
+			    const unsigned char *buf, size_t stride,
+			    int width, int height)
+{
+	uint64_t sum;
+	int x, y, w, h;
+
+	sum = 0;
+	for (y = 0; y < height; y += TILE_SIZE) {
+		h = (height - y < TILE_SIZE) ? height - y : TILE_SIZE;
+		for (x = 0; x < width; x += TILE_SIZE) {
+			w = (width - x < TILE_SIZE) ? width - x : TILE_SIZE;
+			sum += k->hash(buf + y * stride + x * 4, stride, w, h);
+		}
+	}
+	return sum;
+}
+
+static int compare_buffers(const struct tile_kernel *k,
+			   const unsigned char *a, const unsigned char *b,
+			   size_t stride, int width, int height)
+{
+	int x, y, w, h, same;
+
+	same = 0;
+	for (y = 0; y < height; y += TILE_SIZE) {
+		h = (height - y < TILE_SIZE) ? height - y : TILE_SIZE;
+		for (x = 0; x < width; x += TILE_SIZE) {
+			w = (width - x < TILE_SIZE) ? width - x : TILE_SIZE;
+			same += k->equal(a + y * stride + x * 4, stride,
+					 b + y * stride + x * 4, stride, w, h);
+		}
+	}
+	return same;
+}
+
+static uint64_t mask_buffer(const struct tile_kernel *k,
+			    const unsigned char *buf, size_t stride,
+			    int width, int height, unsigned char *bits)
+{
+	uint64_t sum;
+	int x, y;
+
+	sum = 0;
+	for (y = 0; y < height; y++) {
+		k->color_mask(buf + y * stride, width, *(uint32_t *)buf,
+			      0xffffff, bits);
+		for (x = 0; x < (width + 7) / 8; x++)
+			sum = sum * 31 + bits[x];
+	}
+	return sum;
+}
+
+int main(int argc, char *argv[])
+{
+	const struct tile_kernel *kernels;
+	unsigned char *a, *b, *bits;
+	int width, height, iterations, count, i, j, same, ref_same;
+	uint64_t sum, ref_sum, mask, ref_mask;
+	double start, elapsed, gb;
+	size_t stride, size;
+
+	width = DEFAULT_WIDTH;
+	height = DEFAULT_HEIGHT;
+	iterations = DEFAULT_ITERATIONS;
+	if (argc >= 3) {
+		width = atoi(argv[1]);
+		height = atoi(argv[2]);
+	}
+	if (argc >= 4)
+		iterations = atoi(argv[3]);
+	if (width <= 0 || width > MAX_WINDOW_WIDTH ||
+	    height <= 0 || height > MAX_WINDOW_HEIGHT || iterations <= 0)
+		errx(1, "invalid size or iterations");
+
+	stride = (size_t)width * 4;
+	size = stride * height;
+	a = malloc(size);
+	b = malloc(size);
+	bits = malloc((width + 7) / 8);
+	if (!a || !b || !bits)
+		err(1, "malloc");
+
+	srand(1);
+	for (i = 0; (size_t)i < size; i++)
+		a[i] = rand();
+	/* mostly transparent, as a tray icon */
+	for (i = 0; (size_t)i < size; i += 4) {
+		if (rand() % 4)
+			memcpy(a + i, a, 4);
+	}
+	memcpy(b, a, size);
+	/* one differing pixel per row of tiles */
+	for (i = 0; i < height; i += TILE_SIZE)
+		b[i * stride + (i % width) * 4] ^= 1;
+
+	gb = (double)size * iterations / 1e9;
+	printf("%dx%d, %d iterations, %.1f MB per pass\n", width, height,
+	       iterations, size / 1e6);
+
+	kernels = tile_kernels(&count);
+	ref_sum = 0;
+	ref_same = 0;
+	ref_mask = 0;
+	for (i = 0; i < count; i++) {
+		start = now();
+		for (j = 0; j < iterations; j++)
+			sum = hash_buffer(&kernels[i], a, stride, width, height);
+		elapsed = now() - start;
+		printf("%-8s hash    %7.2f GB/s\n", kernels[i].name, gb / elapsed);
+
+		start = now();
+		for (j = 0; j < iterations; j++)
+			same = compare_buffers(&kernels[i], a, b, stride, width,
+					       height);
+		elapsed = now() - start;
+		/* both buffers are read */
+		printf("%-8s compare %7.2f GB/s\n", kernels[i].name,
+		       2 * gb / elapsed);
+
+		start = now();
+		for (j = 0; j < iterations; j++)
+			mask = mask_buffer(&kernels[i], a, stride, width,
+					   height, bits);
+		elapsed = now() - start;
+		printf("%-8s mask    %7.2f GB/s\n", kernels[i].name, gb / elapsed);
+
+		if (i == 0) {
+			ref_sum = sum;
+			ref_same = same;
+			ref_mask = mask;
+		} else if (sum != ref_sum || same != ref_same ||
+			   mask != ref_mask) {
+			errx(1, "%s kernel disagrees with %s kernel",
+			     kernels[i].name, kernels[0].name);
+		}
+	}
+
+	free(a);
+	free(b);
+	free(bits);
+	return 0;
+}
+
+// vim: noet:ts=8:
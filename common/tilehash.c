@@ -0,0 +1,343 @@
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+#include "tilehash.h"
+
+/* Rows are consumed by stripes of 32 bytes (8 pixels) feeding 4 64-bit
+ * accumulators, which maps directly to two SSE2 or one AVX2 register:
+ *
+ *   d = stripe[lane] ^ key[lane]
+ *   acc[lane] += lo32(d) * hi32(d)
+ *   acc[lane ^ 1] += stripe[lane]
+ *
+ * Keys are advanced after each stripe so that moving pixels around changes
+ * the hash. A partial stripe at the end of a row is padded with zeroes. */
+
+#define STRIPE_SIZE	32
+#define LANES		4
+
+#define PRIME1	0x9e3779b185ebca87ULL
+#define PRIME2	0xc2b2ae3d27d4eb4fULL
+#define KEY_STEP	0x165667b19e3779f9ULL
+
+static const uint64_t init_key[LANES] = {
+	0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL,
+	0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+};
+
+static const uint64_t init_acc[LANES] = {
+	PRIME1, PRIME2, KEY_STEP, 0x27d4eb2f165667c5ULL,
+};
+
+
+static uint64_t finalize(const uint64_t acc[LANES], int width, int height)
+{
+	uint64_t h;
+	int i;
+
+	h = (uint64_t)width << 32 | (uint32_t)height;
+	for (i = 0; i < LANES; i++) {
+		h ^= acc[i];
+		h *= PRIME1;
+		h ^= h >> 31;
+	}
+	h ^= h >> 29;
+	h *= PRIME2;
+	h ^= h >> 32;
+
+	return (h != 0) ? h : 1;
+}
+
+/* copy the end of a row to a zero padded stripe */
+static const void *pad_stripe(void *stripe, const unsigned char *p,
+			      size_t len)
+{
+	memset(stripe, 0, STRIPE_SIZE);
+	memcpy(stripe, p, len);
+	return stripe;
+}
+
+static void scalar_stripe(uint64_t acc[LANES], const uint64_t key[LANES],
+			  const void *stripe)
+{
+	uint64_t d, v;
+	int i;
+
+	for (i = 0; i < LANES; i++) {
+		/* memcpy keeps unaligned loads legal */
+		memcpy(&v, (const unsigned char *)stripe + i * 8, sizeof(v));
+		d = v ^ key[i];
+		acc[i] += (d & 0xffffffff) * (d >> 32);
+		acc[i ^ 1] += v;
+	}
+}
+
+static uint64_t scalar_hash(const void *data, size_t stride, int width,
+			    int height)
+{
+	uint64_t acc[LANES], key[LANES], stripe[LANES];
+	const unsigned char *row;
+	size_t len, x;
+	int i, y;
+
+	memcpy(acc, init_acc, sizeof(acc));
+	memcpy(key, init_key, sizeof(key));
+	len = (size_t)width * 4;
+	row = data;
+	for (y = 0; y < height; y++, row += stride) {
+		for (x = 0; x < len; x += STRIPE_SIZE) {
+			if (len - x >= STRIPE_SIZE)
+				scalar_stripe(acc, key, row + x);
+			else
+				scalar_stripe(acc, key,
+					      pad_stripe(stripe, row + x, len - x));
+			for (i = 0; i < LANES; i++)
+				key[i] += KEY_STEP;
+		}
+	}
+
+	return finalize(acc, width, height);
+}
+
+static int scalar_equal(const void *a, size_t stride_a, const void *b,
+			size_t stride_b, int width, int height)
+{
+	const unsigned char *pa = a, *pb = b;
+	int y;
+
+	for (y = 0; y < height; y++, pa += stride_a, pb += stride_b) {
+		if (memcmp(pa, pb, (size_t)width * 4) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+/* mask of the pixels [x, width) of a row, x being a multiple of 8 */
+static void scalar_color_mask_from(const uint32_t *row, int x, int width,
+				   uint32_t color, uint32_t planes,
+				   unsigned char *bits)
+{
+	uint32_t v;
+
+	for (; x < width; x++) {
+		if (x % 8 == 0)
+			bits[x / 8] = 0;
+		memcpy(&v, &row[x], sizeof(v));
+		if ((v & planes) != color)
+			bits[x / 8] |= 1 << (x % 8);
+	}
+}
+
+static void scalar_color_mask(const void *row, int width, uint32_t color,
+			      uint32_t planes, unsigned char *bits)
+{
+	scalar_color_mask_from(row, 0, width, color, planes, bits);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("sse2")))
+static uint64_t sse2_hash(const void *data, size_t stride, int width,
+			  int height)
+{
+	__m128i acc0, acc1, key0, key1, step, v0, v1, d0, d1;
+	uint64_t acc[LANES], stripe[LANES];
+	const unsigned char *row, *p;
+	size_t len, x;
+	int y;
+
+	acc0 = _mm_loadu_si128((const __m128i *)&init_acc[0]);
+	acc1 = _mm_loadu_si128((const __m128i *)&init_acc[2]);
+	key0 = _mm_loadu_si128((const __m128i *)&init_key[0]);
+	key1 = _mm_loadu_si128((const __m128i *)&init_key[2]);
+	step = _mm_set1_epi64x(KEY_STEP);
+	len = (size_t)width * 4;
+	row = data;
+	for (y = 0; y < height; y++, row += stride) {
+		for (x = 0; x < len; x += STRIPE_SIZE) {
+			p = row + x;
+			if (len - x < STRIPE_SIZE)
+				p = pad_stripe(stripe, p, len - x);
+			v0 = _mm_loadu_si128((const __m128i *)p);
+			v1 = _mm_loadu_si128((const __m128i *)(p + 16));
+			d0 = _mm_xor_si128(v0, key0);
+			d1 = _mm_xor_si128(v1, key1);
+			acc0 = _mm_add_epi64(acc0,
+				_mm_mul_epu32(d0, _mm_srli_epi64(d0, 32)));
+			acc1 = _mm_add_epi64(acc1,
+				_mm_mul_epu32(d1, _mm_srli_epi64(d1, 32)));
+			acc0 = _mm_add_epi64(acc0,
+				_mm_shuffle_epi32(v0, _MM_SHUFFLE(1, 0, 3, 2)));
+			acc1 = _mm_add_epi64(acc1,
+				_mm_shuffle_epi32(v1, _MM_SHUFFLE(1, 0, 3, 2)));
+			key0 = _mm_add_epi64(key0, step);
+			key1 = _mm_add_epi64(key1, step);
+		}
+	}
+
+	_mm_storeu_si128((__m128i *)&acc[0], acc0);
+	_mm_storeu_si128((__m128i *)&acc[2], acc1);
+	return finalize(acc, width, height);
+}
+
+__attribute__((target("sse2")))
+static int sse2_equal(const void *a, size_t stride_a, const void *b,
+		      size_t stride_b, int width, int height)
+{
+	const unsigned char *pa = a, *pb = b;
+	__m128i diff;
+	size_t len, x;
+	int y;
+
+	len = (size_t)width * 4;
+	for (y = 0; y < height; y++, pa += stride_a, pb += stride_b) {
+		diff = _mm_setzero_si128();
+		for (x = 0; x + 16 <= len; x += 16)
+			diff = _mm_or_si128(diff, _mm_xor_si128(
+				_mm_loadu_si128((const __m128i *)(pa + x)),
+				_mm_loadu_si128((const __m128i *)(pb + x))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff,
+				_mm_setzero_si128())) != 0xffff)
+			return 0;
+		if (x < len && memcmp(pa + x, pb + x, len - x) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+__attribute__((target("sse2")))
+static void sse2_color_mask(const void *row, int width, uint32_t color,
+			    uint32_t planes, unsigned char *bits)
+{
+	const uint32_t *p = row;
+	__m128i c, m, v0, v1;
+	int x, eq;
+
+	c = _mm_set1_epi32(color);
+	m = _mm_set1_epi32(planes);
+	for (x = 0; x + 8 <= width; x += 8) {
+		v0 = _mm_and_si128(_mm_loadu_si128((const __m128i *)(p + x)), m);
+		v1 = _mm_and_si128(_mm_loadu_si128((const __m128i *)(p + x + 4)), m);
+		eq = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v0, c))) |
+			_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v1, c))) << 4;
+		bits[x / 8] = ~eq;
+	}
+	scalar_color_mask_from(p, x, width, color, planes, bits);
+}
+
+__attribute__((target("avx2")))
+static uint64_t avx2_hash(const void *data, size_t stride, int width,
+			  int height)
+{
+	__m256i acc0, key0, step, v0, d0;
+	uint64_t acc[LANES], stripe[LANES];
+	const unsigned char *row, *p;
+	size_t len, x;
+	int y;
+
+	acc0 = _mm256_loadu_si256((const __m256i *)init_acc);
+	key0 = _mm256_loadu_si256((const __m256i *)init_key);
+	step = _mm256_set1_epi64x(KEY_STEP);
+	len = (size_t)width * 4;
+	row = data;
+	for (y = 0; y < height; y++, row += stride) {
+		for (x = 0; x < len; x += STRIPE_SIZE) {
+			p = row + x;
+			if (len - x < STRIPE_SIZE)
+				p = pad_stripe(stripe, p, len - x);
+			v0 = _mm256_loadu_si256((const __m256i *)p);
+			d0 = _mm256_xor_si256(v0, key0);
+			acc0 = _mm256_add_epi64(acc0,
+				_mm256_mul_epu32(d0, _mm256_srli_epi64(d0, 32)));
+			/* swaps 64-bit halves inside each 128-bit lane */
+			acc0 = _mm256_add_epi64(acc0,
+				_mm256_shuffle_epi32(v0, _MM_SHUFFLE(1, 0, 3, 2)));
+			key0 = _mm256_add_epi64(key0, step);
+		}
+	}
+
+	_mm256_storeu_si256((__m256i *)acc, acc0);
+	return finalize(acc, width, height);
+}
+
+__attribute__((target("avx2")))
+static int avx2_equal(const void *a, size_t stride_a, const void *b,
+		      size_t stride_b, int width, int height)
+{
+	const unsigned char *pa = a, *pb = b;
+	__m256i diff;
+	size_t len, x;
+	int y;
+
+	len = (size_t)width * 4;
+	for (y = 0; y < height; y++, pa += stride_a, pb += stride_b) {
+		diff = _mm256_setzero_si256();
+		for (x = 0; x + 32 <= len; x += 32)
+			diff = _mm256_or_si256(diff, _mm256_xor_si256(
+				_mm256_loadu_si256((const __m256i *)(pa + x)),
+				_mm256_loadu_si256((const __m256i *)(pb + x))));
+		if (!_mm256_testz_si256(diff, diff))
+			return 0;
+		if (x < len && memcmp(pa + x, pb + x, len - x) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+__attribute__((target("avx2")))
+static void avx2_color_mask(const void *row, int width, uint32_t color,
+			    uint32_t planes, unsigned char *bits)
+{
+	const uint32_t *p = row;
+	__m256i c, m, v;
+	int x;
+
+	c = _mm256_set1_epi32(color);
+	m = _mm256_set1_epi32(planes);
+	for (x = 0; x + 8 <= width; x += 8) {
+		v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(p + x)), m);
+		bits[x / 8] = ~_mm256_movemask_ps(
+			_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, c)));
+	}
+	scalar_color_mask_from(p, x, width, color, planes, bits);
+}
+
+#endif /* HAVE_X86_KERNELS */
+
+static const struct tile_kernel kernels[] = {
+	{ "scalar", scalar_hash, scalar_equal, scalar_color_mask },
+#ifdef HAVE_X86_KERNELS
+	{ "sse2", sse2_hash, sse2_equal, sse2_color_mask },
+	{ "avx2", avx2_hash, avx2_equal, avx2_color_mask },
+#endif
+};
+
+const struct tile_kernel *tile_kernel;
+
+
+const struct tile_kernel *tile_kernels(int *count)
+{
+	*count = 1;
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		*count = 2;
+		if (__builtin_cpu_supports("avx2"))
+			*count = 3;
+	}
+#endif
+	return kernels;
+}
+
+void tile_kernel_init(void)
+{
+	int count;
+
+	tile_kernel = &tile_kernels(&count)[count - 1];
+}
+
+// vim: noet:ts=8:
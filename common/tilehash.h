@@ -0,0 +1,61 @@
+#ifndef _TILEHASH_H
+#define _TILEHASH_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* windows are hashed by square tiles of TILE_SIZE x TILE_SIZE pixels */
+#define TILE_SIZE	64
+
+/* Kernels working on rectangles of 32bpp pixels; stride is the distance in
+ * bytes between the beginning of two rows. Scalar, SSE2 and AVX2 versions
+ * exist and the fastest one supported by the CPU is picked on first use.
+ * Every version returns the same hash for the same pixels. */
+struct tile_kernel {
+	const char *name;
+	/* never returns 0, which callers can use as "unknown" */
+	uint64_t (*hash)(const void *data, size_t stride, int width,
+			 int height);
+	/* return 1 if both rectangles hold the same pixels */
+	int (*equal)(const void *a, size_t stride_a, const void *b,
+		     size_t stride_b, int width, int height);
+	/* set a bit in bits for each pixel of row for which
+	 * (pixel & planes) != color, least significant bit first as expected
+	 * by XCreateBitmapFromData; (width + 7) / 8 bytes are written */
+	void (*color_mask)(const void *row, int width, uint32_t color,
+			   uint32_t planes, unsigned char *bits);
+};
+
+extern const struct tile_kernel *tile_kernel;
+
+void tile_kernel_init(void);
+/* kernels supported by this CPU, slowest first */
+const struct tile_kernel *tile_kernels(int *count);
+
+static inline uint64_t tile_hash(const void *data, size_t stride, int width,
+				 int height)
+{
+	if (!tile_kernel)
+		tile_kernel_init();
+	return tile_kernel->hash(data, stride, width, height);
+}
+
+static inline int tile_equal(const void *a, size_t stride_a, const void *b,
+			     size_t stride_b, int width, int height)
+{
+	if (!tile_kernel)
+		tile_kernel_init();
+	return tile_kernel->equal(a, stride_a, b, stride_b, width, height);
+}
+
+static inline void color_mask(const void *row, int width, uint32_t color,
+			      uint32_t planes, unsigned char *bits)
+{
+	if (!tile_kernel)
+		tile_kernel_init();
+	tile_kernel->color_mask(row, width, color, planes, bits);
+}
+
+#endif /* _TILEHASH_H */
+
+// vim: noet:ts=8:
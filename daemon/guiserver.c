@@ -38,6 +38,9 @@
 #include "guiserver.h"
 #include "qubes-gui-protocol.h"
 #include "list.h"
+#include "server_common.h"
+#include "render.h"
+#include "xconn.h"
 #include "child.h"
 #include "policy.h"
 #include "userland.h"
@@ -94,6 +97,16 @@ static void get_frame_gc(Ghandles *ghandles, int rgb)
 	ghandles->frame_gc = XCreateGC(ghandles->display, ghandles->root_win, GCForeground, &values);
 }
 
+#ifdef FILL_TRAY_BG
+static void get_tray_gc(Ghandles *g)
+{
+	XGCValues values;
+
+	values.foreground = WhitePixel(g->display, g->screen);
+	g->tray_gc = XCreateGC(g->display, g->root_win, GCForeground, &values);
+}
+#endif
+
 static int x11_error_handler(Display * dpy, XErrorEvent * ev)
 {
 	/* log the error */
@@ -138,28 +151,39 @@ static void mkghandles(Ghandles *g, int lock_fd)
 {
 	char tray_sel_atom_name[64];
 	XWindowAttributes attr;
-
+	const struct atom_name atoms[] = {
+		{ &g->wmDeleteMessage, "WM_DELETE_WINDOW" },
+		{ &g->tray_selection, tray_sel_atom_name },
+		{ &g->tray_opcode, "_NET_SYSTEM_TRAY_OPCODE" },
+		{ &g->xembed_message, "_XEMBED" },
+		{ &g->xembed_info, "_XEMBED_INFO" },
+		{ &g->wm_state, "_NET_WM_STATE" },
+		{ &g->wm_state_fullscreen, "_NET_WM_STATE_FULLSCREEN" },
+		{ &g->wm_state_demands_attention,
+		  "_NET_WM_STATE_DEMANDS_ATTENTION" },
+		{ &g->wm_state_hidden, "_NET_WM_STATE_HIDDEN" },
+		{ &g->frame_extents, "_NET_FRAME_EXTENTS" },
+		{ &g->wm_state_maximized_vert, "_NET_WM_STATE_MAXIMIZED_VERT" },
+		{ &g->wm_state_maximized_horz, "_NET_WM_STATE_MAXIMIZED_HORZ" },
+		{ &g->qubes_label, "_QUBES_LABEL" },
+		{ &g->qubes_vmname, "_QUBES_VMNAME" },
+	};
+
+	xconn_init(g);
 	g->screen = DefaultScreen(g->display);
 	g->root_win = RootWindow(g->display, g->screen);
 	XGetWindowAttributes(g->display, g->root_win, &attr);
 	g->root_width = _VIRTUALX(attr.width);
 	g->root_height = attr.height;
 	g->context = XCreateGC(g->display, g->root_win, 0, NULL);
-	g->wmDeleteMessage =
-	    XInternAtom(g->display, "WM_DELETE_WINDOW", True);
+	/* copies from window backing pixmaps never miss a source area,
+	 * don't get a NoExpose event for each of them */
+	XSetGraphicsExposures(g->display, g->context, False);
 	g->clipboard_requested = 0;
 	snprintf(tray_sel_atom_name, sizeof(tray_sel_atom_name),
 		 "_NET_SYSTEM_TRAY_S%u", DefaultScreen(g->display));
-	g->tray_selection =
-	    XInternAtom(g->display, tray_sel_atom_name, False);
-	g->tray_opcode =
-	    XInternAtom(g->display, "_NET_SYSTEM_TRAY_OPCODE", False);
-	g->xembed_message = XInternAtom(g->display, "_XEMBED", False);
-	g->xembed_info = XInternAtom(g->display, "_XEMBED_INFO", False);
-	g->wm_state = XInternAtom(g->display, "_NET_WM_STATE", False);
-	g->wm_state_fullscreen =XInternAtom(g->display, "_NET_WM_STATE_FULLSCREEN", False);
-	g->wm_state_demands_attention = XInternAtom(g->display, "_NET_WM_STATE_DEMANDS_ATTENTION", False);
-	g->frame_extents = XInternAtom(g->display, "_NET_FRAME_EXTENTS", False);
+	/* atoms used with windows are interned once, with one round trip */
+	intern_atoms(g, atoms, sizeof(atoms) / sizeof(atoms[0]));
 
 	/* initialize windows limit */
 	g->windows_count_limit = g->windows_count_limit_param;
@@ -216,6 +240,54 @@ static int shm_init(Ghandles *g, uid_t uid, char *display)
 	return 0;
 }
 
+/* discard eventfd notification */
+static int xchan_notified(struct event_source *src)
+{
+	struct xchan *xchan = src->arg;
+	err_t error;
+
+	error = xchan_poll(xchan);
+	if (error) {
+		print_error(error, "xchan poll failed");
+		return -1;
+	}
+	return 0;
+}
+
+static unsigned int run_xevents(void *arg, unsigned int max)
+{
+	Ghandles *g = arg;
+	unsigned int n;
+
+	for (n = 0; n < max && XEventsQueued(g->display, QueuedAfterReading);
+	     n++)
+		process_xevent(g);
+	/* input forwarded to the agent doesn't wait for the VM messages and
+	 * timers of the pass, the age limit of corked output isn't checked
+	 * until something else is written */
+	if (n > 0)
+		push_output(g->xchan);
+	return n;
+}
+
+static unsigned int xevents_depth(void *arg)
+{
+	Ghandles *g = arg;
+
+	return XEventsQueued(g->display, QueuedAfterReading);
+}
+
+static unsigned int run_messages(void *arg, unsigned int max)
+{
+	return handle_messages(arg, max);
+}
+
+static int frame_timer_expired(struct event_source *src)
+{
+	frame_tick(src->arg);
+	return 0;
+}
+
 static struct serve_arg *init(struct child_arg *arg)
 {
 	struct serve_arg *serve_arg;
@@ -248,6 +320,13 @@ static struct serve_arg *init(struct child_arg *arg)
 	snprintf(path, sizeof(path), "/run/user/%d/gdm/Xauthority", arg->uid);
 	setenv("XAUTHORITY", path, 1);
 
+	/* the render thread has its own connection, but Xlib has some
+	 * global state */
+	if (ghandles.render_thread && !XInitThreads()) {
+		warnx("XInitThreads failed, no render thread");
+		ghandles.render_thread = 0;
+	}
+
 	ghandles.display = XOpenDisplay(arg->display);
 	if (ghandles.display == NULL) {
 		warn("XOpenDisplay");
@@ -259,6 +338,15 @@ static struct serve_arg *init(struct child_arg *arg)
 	mkghandles(&ghandles, lock_fd);
 	XSetErrorHandler(x11_error_handler);
 
+	ghandles.shm_completion_type =
+		XShmGetEventBase(ghandles.display) + ShmCompletion;
+
+	if (ghandles.update_mode == UPDATE_SHM_PIXMAP &&
+	    XShmPixmapFormat(ghandles.display) != ZPixmap) {
+		warnx("X server doesn't support shared pixmaps, using backing pixmaps");
+		ghandles.update_mode = UPDATE_BACKING_PIXMAP;
+	}
+
 	ghandles.capsule_id = arg->capsule_id;
 
 	printf("[*] color: #%03x (%s)\n", policy->window_color, policy->name);
@@ -289,6 +377,22 @@ static struct serve_arg *init(struct child_arg *arg)
 	get_tray_gc(&ghandles);
 #endif
 
+	if (event_loop_init(&ghandles.events) != 0)
+		return NULL;
+	ghandles.frame_timer = event_add_timer(&ghandles.events,
+					       frame_timer_expired, &ghandles);
+	if (ghandles.frame_timer == NULL)
+		return NULL;
+	/* puts of other modes are followed by copies on the main
+	 * connection, which must not overtake them */
+	if (ghandles.render_thread && ghandles.update_mode != UPDATE_DIRECT)
+		warnx("render thread requires the direct update mode");
+	else if (ghandles.render_thread &&
+		 render_start(&ghandles, arg->display) != 0)
+		return NULL;
+	ghandles.backing_bytes = 0;
+	ghandles.frame_interval = ghandles.frame_interval_param;
+
 	error = xchan_accept(ghandles.xchan);
 	if (error) {
 		print_error(error, "failed to accept gui client");
@@ -300,6 +404,10 @@ static struct serve_arg *init(struct child_arg *arg)
 		return NULL;
 	}
 
+	/* features are enabled once the agent answers */
+	ghandles.features = 0;
+	send_capabilities(&ghandles);
+
 	serve_arg = (struct serve_arg *)malloc(sizeof(*serve_arg));
 	if (serve_arg == NULL) {
 		warn("malloc");
@@ -311,41 +419,52 @@ static struct serve_arg *init(struct child_arg *arg)
 
 static void serve(struct serve_arg *arg)
 {
-	struct pollfd pollfds[2];
-	err_t error;
-	int busy;
-
-	pollfds[0].fd = ghandles.xchan->event_fd;
-	pollfds[0].events = POLLIN;
-
-	pollfds[1].fd = ConnectionNumber(ghandles.display);
-	pollfds[1].events = POLLIN;
+	struct event_queue queues[2] = {
+		{ .name = "X events", .run = run_xevents,
+		  .depth = xevents_depth, .arg = &ghandles, .input = 1,
+		  .budget = XEVENT_BUDGET },
+		{ .name = "VM messages", .run = run_messages,
+		  .arg = &ghandles, .budget = MESSAGE_BUDGET,
+		  .budget_us = MESSAGE_BUDGET_US },
+	};
+	Display *dpy = ghandles.display;
+	int more = 0;
+
+	/* the agent writes the eventfd for each message it sends: each of
+	 * them is one new edge, whether or not the previous ones were read */
+	if (event_add_fd(&ghandles.events, ghandles.xchan->event_fd, 1,
+			 xchan_notified, ghandles.xchan) == NULL)
+		goto out;
+	/* X events are read by Xlib, the source only wakes the loop up */
+	if (event_add_fd(&ghandles.events, ConnectionNumber(dpy), 0, NULL,
+			 NULL) == NULL)
+		goto out;
 
 	while (1) {
-		if (TEMP_FAILURE_RETRY(poll(pollfds, 2, -1)) == -1)
+		/* events already read by Xlib don't make its fd readable,
+		 * neither do messages left by the previous pass */
+		if (event_wait(&ghandles.events, (more ||
+			       XEventsQueued(dpy, QueuedAlready)) ? 0 : -1) != 0)
 			break;
 
-		/* discard eventfd notification */
-		if (pollfds[0].revents & POLLIN) {
-			error = xchan_poll(ghandles.xchan);
-			if (error) {
-				print_error(error, "xchan poll failed");
-				break;
-			}
-		}
-
-		do {
-			busy = 0;
-			if (XPending(ghandles.display)) {
-				process_xevent(&ghandles);
-				busy = 1;
-			}
+		/* messages produced by this batch are sent at once */
+		cork_output(ghandles.xchan);
+		/* requests are flushed once per pass */
+		more = event_schedule(queues, 2);
 
-			if (handle_message(&ghandles))
-				busy = 1;
-		} while (busy);
+		if (event_run_timers(&ghandles.events) != 0)
+			break;
+		flush_output(ghandles.xchan);
+		XFlush(dpy);
+		render_flush(&ghandles);
+		if (ghandles.log_level > 1) {
+			report_output_stats();
+			event_report_queues(queues, 2);
+			report_round_trips();
+		}
 	}
 
+out:
 	free(arg);
 
 	XCloseDisplay(ghandles.display);
@@ -355,7 +474,7 @@ static void serve(struct serve_arg *arg)
 static void usage(void)
 {
 	fprintf(stderr,
-		"usage: qubes-guid [-d] [-i icon name, no suffix, or icon.png path] [-v] [-q] [-a] [-f] [-V]\n");
+		"usage: qubes-guid [-d] [-i icon name, no suffix, or icon.png path] [-v] [-q] [-a] [-f] [-F ms] [-L ms] [-U mode] [-H] [-T] [-V]\n");
 	fprintf(stderr, "       -d  debug\n");
 	fprintf(stderr, "       -v  increase log verbosity\n");
 	fprintf(stderr, "       -q  decrease log verbosity\n");
@@ -363,6 +482,21 @@ static void usage(void)
 	fprintf(stderr, "       -n  run without hypervisor\n");
 	fprintf(stderr, "       -a  low-latency audio mode\n");
 	fprintf(stderr, "       -f  do not fork into background\n");
+	fprintf(stderr, "       -F  minimum interval between window updates in ms, 0 to disable\n");
+	fprintf(stderr, "           pacing (default: %d, or $CAPPSULE_GUI_FRAME_MS)\n", DEFAULT_FRAME_INTERVAL_MS);
+	fprintf(stderr, "       -L  time a window update may take before pending input is\n");
+	fprintf(stderr, "           served, the rest of the update is done afterwards\n");
+	fprintf(stderr, "           (default: %d)\n", DEFAULT_UPLOAD_BUDGET_MS);
+	fprintf(stderr, "       -U  how window content is updated (or $CAPPSULE_GUI_UPDATE_MODE):\n");
+	fprintf(stderr, "           direct   put guest memory to windows (default)\n");
+	fprintf(stderr, "           backing  keep a copy of windows in the X server, exposes\n");
+	fprintf(stderr, "                    don't read guest memory (4 bytes per pixel)\n");
+	fprintf(stderr, "           shm      use guest memory as pixmaps, updates are copies\n");
+	fprintf(stderr, "                    inside the X server\n");
+	fprintf(stderr, "       -H  use pointer motion hints: the X server reports no more\n");
+	fprintf(stderr, "           motion until the position is queried\n");
+	fprintf(stderr, "       -T  put window images from a render thread, with the\n");
+	fprintf(stderr, "           direct update mode\n");
 	fprintf(stderr, "       -V  display the version number\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Log levels:\n");
@@ -371,8 +505,22 @@ static void usage(void)
 	fprintf(stderr, " 2 - debug\n");
 }
 
+static int parse_update_mode(const char *name, enum update_mode *mode)
+{
+	if (strcmp(name, "direct") == 0)
+		*mode = UPDATE_DIRECT;
+	else if (strcmp(name, "backing") == 0)
+		*mode = UPDATE_BACKING_PIXMAP;
+	else if (strcmp(name, "shm") == 0)
+		*mode = UPDATE_SHM_PIXMAP;
+	else
+		return -1;
+	return 0;
+}
+
 static void parse_cmdline(Ghandles *g, int argc, char **argv)
 {
+	char *p;
 	int opt;
 
 	/* defaults */
@@ -384,8 +532,15 @@ static void parse_cmdline(Ghandles *g, int argc, char **argv)
 	/* XXX: servers are launched by daemon whitout arguments. Get this
 	 * option from environment. */
 	g->nohv = (getenv("CAPPSULE_NOHV") != NULL);
-
-	while ((opt = getopt(argc, argv, "dc:l:i:vqQnafV")) != -1) {
+	p = getenv("CAPPSULE_GUI_FRAME_MS");
+	g->frame_interval_param = (p != NULL) ? atoi(p) : DEFAULT_FRAME_INTERVAL_MS;
+	g->update_mode = UPDATE_DIRECT;
+	g->upload_budget_ms = DEFAULT_UPLOAD_BUDGET_MS;
+	p = getenv("CAPPSULE_GUI_UPDATE_MODE");
+	if (p != NULL && parse_update_mode(p, &g->update_mode) != 0)
+		warnx("invalid CAPPSULE_GUI_UPDATE_MODE \"%s\"", p);
+
+	while ((opt = getopt(argc, argv, "dc:l:i:vqQnafF:L:U:HTV")) != -1) {
 		switch (opt) {
 		/*case 'a':
 			g->audio_low_latency = 1;
@@ -413,6 +568,26 @@ static void parse_cmdline(Ghandles *g, int argc, char **argv)
 		case 'f':
 			g->nofork = 1;
 			break;
+		case 'F':
+			g->frame_interval_param = atoi(optarg);
+			break;
+		case 'L':
+			g->upload_budget_ms = atoi(optarg);
+			if (g->upload_budget_ms < 0)
+				g->upload_budget_ms = 0;
+			break;
+		case 'U':
+			if (parse_update_mode(optarg, &g->update_mode) != 0) {
+				usage();
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'H':
+			g->motion_hint = 1;
+			break;
+		case 'T':
+			g->render_thread = 1;
+			break;
 		case 'V':
 			display_version(argv[0], version, 1);
 			break;
@@ -421,6 +596,11 @@ static void parse_cmdline(Ghandles *g, int argc, char **argv)
 			exit(EXIT_FAILURE);
 		}
 	}
+
+	if (g->frame_interval_param < 0)
+		g->frame_interval_param = 0;
+	else if (g->frame_interval_param > MAX_FRAME_INTERVAL_MS)
+		g->frame_interval_param = MAX_FRAME_INTERVAL_MS;
 }
 
 int main(int argc, char *argv[])
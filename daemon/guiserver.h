@@ -8,7 +8,45 @@
 #include <X11/Xatom.h>
 #include <X11/extensions/XShm.h>
 
+#include "damage.h"
+#include "event.h"
+
+/* default interval between two updates of the same window */
+#define DEFAULT_FRAME_INTERVAL_MS	16
+/* upper bound of the interval when it is stretched under load */
+#define MAX_FRAME_INTERVAL_MS		100
+
+/* XShmPutImage requests not yet completed by the X server, per window
+ * image; further updates are merged in the dirty region meanwhile */
+#define MAX_PENDING_PUTS		2
+/* completion events may be lost if a put fails, don't wait forever */
+#define PENDING_PUTS_TIMEOUT_MS		1000
+
+/* large updates are put by stripes of about this size, pending events are
+ * served between stripes once the update took more than the budget */
+#define UPLOAD_STRIPE_BYTES		(1024 * 1024)
+#define DEFAULT_UPLOAD_BUDGET_MS	4
+
+/* the main loop runs host X events, input first of all, then VM messages,
+ * in rounds: a round runs at most this number of each, and VM messages no
+ * longer than this budget */
+#define XEVENT_BUDGET			64
+#define MESSAGE_BUDGET			32
+#define MESSAGE_BUDGET_US		2000
+
+/* protocol features offered to the agent, see struct msg_capabilities */
+#define DAEMON_FEATURES			CAP_SHMIMAGE_BATCH
+
+/* how window content is pushed to the X server */
+enum update_mode {
+	UPDATE_DIRECT,		/* XShmPutImage from guest memory to the window */
+	UPDATE_BACKING_PIXMAP,	/* through a pixmap which also serves exposes */
+	UPDATE_SHM_PIXMAP,	/* copy from a MIT-SHM pixmap over guest memory */
+};
+
 /* per-window data */
+struct render;
+
 struct windowdata {
 	unsigned width;
 	unsigned height;
@@ -27,11 +65,26 @@ struct windowdata {
 	int image_width;
 	int have_queued_configure;	/* have configure request been sent to VM - waiting for confirmation */
 	uint32_t flags_set;	/* window flags acked to gui-agent */
+	struct damage_region dirty;	/* not yet sanitized, updated on next frame tick */
+	Pixmap backing;		/* copy of image in UPDATE_BACKING_PIXMAP mode, image
+				 * itself in UPDATE_SHM_PIXMAP mode, or None */
+	int backing_is_background;	/* backing is the window background */
+	int is_obscured;	/* fully obscured or unmapped on local X server */
+	int is_hidden;		/* _NET_WM_STATE_HIDDEN set by window manager */
+	int puts_pending;	/* updates from image waiting for ShmCompletion */
+	struct timespec puts_since;	/* time of the last completion or put */
+#ifdef FILL_TRAY_BG
+	Pixmap tray_pixmap;	/* copy of docked icon content, None if not painted yet */
+	Pixmap tray_mask;	/* transparency mask of docked icon */
+	unsigned char *tray_bits;	/* data of tray_mask */
+	unsigned long tray_back;	/* transparency color */
+#endif
 };
 
 struct _global_handles {
 	/* local X server handles and attributes */
 	Display *display;
+	struct xcb_connection_t *xcb;	/* same connection, see xconn.h */
 	int screen;		/* shortcut to the default screen */
 	Window root_win;	/* root attributes */
 	int root_width;		/* size of root window */
@@ -50,7 +103,12 @@ struct _global_handles {
 	Atom wm_state;         /* Atom: _NET_WM_STATE */
 	Atom wm_state_fullscreen; /* Atom: _NET_WM_STATE_FULLSCREEN */
 	Atom wm_state_demands_attention; /* Atom: _NET_WM_STATE_DEMANDS_ATTENTION */
+	Atom wm_state_hidden;	/* Atom: _NET_WM_STATE_HIDDEN */
 	Atom frame_extents; /* Atom: _NET_FRAME_EXTENTS */
+	Atom wm_state_maximized_vert; /* Atom: _NET_WM_STATE_MAXIMIZED_VERT */
+	Atom wm_state_maximized_horz; /* Atom: _NET_WM_STATE_MAXIMIZED_HORZ */
+	Atom qubes_label;	/* Atom: _QUBES_LABEL */
+	Atom qubes_vmname;	/* Atom: _QUBES_VMNAME */
 	/* shared memory handling */
 	struct shm_cmd *shmcmd;	/* shared memory with Xorg */
 	uint32_t cmd_shmid;		/* shared memory id - received from shmoverride.so through shm.id file */
@@ -71,6 +129,12 @@ struct _global_handles {
 	int windows_count_limit;	/* current window limit; ask user what to do when exceeded */
 	int windows_count_limit_param; /* initial limit of created windows - after exceed, warning the user */
 	struct windowdata *last_input_window;
+	/* frame pacing */
+	struct event_loop events;	/* main loop sources */
+	struct event_source *frame_timer; /* armed when some window is dirty */
+	int frame_interval;	/* current interval in ms, adapted to load */
+	size_t backing_bytes;	/* memory used by backing pixmaps */
+	int shm_completion_type;	/* event type of ShmCompletion */
 	/* configuration */
 	int log_level;		/* log level */
 	int nohv;
@@ -83,6 +147,13 @@ struct _global_handles {
 	KeySym paste_seq_key;	/* key for secure-paste key sequence */
 	int qrexec_clipboard;	/* 0: use GUI protocol to fetch/put clipboard, 1: use qrexec */
 	int use_kdialog;	/* use kdialog for prompts (default on KDE) or zenity (default on non-KDE) */
+	int frame_interval_param;	/* minimum interval between window updates in ms, 0 to update immediately */
+	enum update_mode update_mode;
+	int upload_budget_ms;	/* time an update may take before events are served */
+	int motion_hint;	/* report one motion per pointer query */
+	int render_thread;	/* put window images from a render thread */
+	struct render *render;	/* NULL unless the render thread runs */
+	uint32_t features;	/* protocol features both sides support */
 	unsigned int capsule_id;
 
 	int debug;
@@ -95,7 +166,8 @@ typedef struct _global_handles Ghandles;
 #define FULLSCREEN_WINDOW_ID 0
 
 void process_xevent(Ghandles * g);
-bool handle_message(Ghandles * g);
+unsigned int handle_messages(Ghandles * g, unsigned int max);
+void send_capabilities(Ghandles * g);
 
 #endif /* _GUISERVER_H */
 
@@ -40,6 +40,8 @@
 #include "list.h"
 #include "gui_common.h"
 #include "server_common.h"
+#include "render.h"
+#include "xconn.h"
 #include "xchan.h"
 
 #define min(x, y)	((x) < (y) ? (x) : (y))
@@ -76,7 +78,6 @@ static Window mkwindow(Ghandles * g, struct windowdata *vm_window)
 	Window child_win;
 	Window parent;
 	XSizeHints my_size_hints;	/* hints for the window manager */
-	Atom atom_label;
 
 	my_size_hints.flags = PSize;
 	my_size_hints.width = vm_window->width;
@@ -102,17 +103,17 @@ static Window mkwindow(Ghandles * g, struct windowdata *vm_window)
 			    ExposureMask | KeyPressMask | KeyReleaseMask |
 			    ButtonPressMask | ButtonReleaseMask |
 			    PointerMotionMask | EnterWindowMask | LeaveWindowMask |
-			    FocusChangeMask | StructureNotifyMask | PropertyChangeMask);
+			    FocusChangeMask | StructureNotifyMask | PropertyChangeMask |
+			    VisibilityChangeMask |
+			    (g->motion_hint ? PointerMotionHintMask : 0));
 	XSetWMProtocols(g->display, child_win, &g->wmDeleteMessage, 1);
 	// Set '_QUBES_LABEL' property so that Window Manager can read it and draw proper decoration
-	atom_label = XInternAtom(g->display, "_QUBES_LABEL", 0);
-	XChangeProperty(g->display, child_win, atom_label, XA_INTEGER,
+	XChangeProperty(g->display, child_win, g->qubes_label, XA_INTEGER,
 			32, PropModeReplace,
 			(unsigned char *) &g->label_index, 1);
 
 	// Set '_QUBES_VMNAME' property so that Window Manager can read it and nicely display it
-	atom_label = XInternAtom(g->display, "_QUBES_VMNAME", 0);
-	XChangeProperty(g->display, child_win, atom_label, XA_STRING,
+	XChangeProperty(g->display, child_win, g->qubes_vmname, XA_STRING,
 			8 /* 8 bit is enough */ , PropModeReplace,
 			(const unsigned char *) g->vmname,
 			strlen(g->vmname));
@@ -138,6 +139,7 @@ static void moveresize_vm_window(Ghandles * g, struct windowdata *vm_window)
 	if (!vm_window->is_docked) {
 		/* we have window content coordinates, but XMoveResizeWindow requires
 		 * left top *border* pixel coordinates (if any border is present). */
+		count_round_trip();
 		ret = XGetWindowProperty(g->display, vm_window->local_winid, g->frame_extents, 0, 4,
 				False, XA_CARDINAL, &act_type, &act_fmt, &nitems, &bytesleft, (unsigned char**)&frame_extents);
 		if (ret == Success && nitems == 4) {
@@ -149,11 +151,13 @@ static void moveresize_vm_window(Ghandles * g, struct windowdata *vm_window)
 			x = vm_window->x;
 			y = vm_window->y;
 		}
-	} else
+	} else {
+		count_round_trip();
 		if (!XTranslateCoordinates(g->display, g->root_win,
 				      vm_window->local_winid, vm_window->x,
 				      vm_window->y, &x, &y, &win))
 			return;
+	}
 	if (g->log_level > 1)
 		fprintf(stderr,
 			"XMoveResizeWindow local 0x%x remote 0x%x, xy %d %d (vm_window is %d %d) wh %d %d\n",
@@ -213,15 +217,10 @@ static int force_on_screen(Ghandles * g, struct windowdata *vm_window,
 	return do_move;
 }
 
-/* handle VM message: MSG_CREATE
- * checks given attributes and create appropriate window in local Xserver
- * (using mkwindow) */
-static void handle_create(Ghandles * g, XID window)
+/* allocate the windowdata of a window the VM is creating */
+static struct windowdata *new_window(Ghandles * g, XID window)
 {
 	struct windowdata *vm_window;
-	struct genlist *l;
-	struct msg_create untrusted_crt;
-	XID parent;
 
 	if (g->windows_count++ > g->windows_count_limit)
 		ask_whether_flooding(g);
@@ -237,25 +236,38 @@ static void handle_create(Ghandles * g, XID window)
 	   vm_window->local_winid = 0;
 	   vm_window->dest = vm_window->src = vm_window->pix = 0;
 	 */
-	read_struct(g->xchan, untrusted_crt);
+	vm_window->remote_winid = window;
+	return vm_window;
+}
+
+/* handle VM message: MSG_CREATE
+ * checks given attributes and create appropriate window in local Xserver
+ * (using mkwindow) */
+static void handle_create(Ghandles * g, struct windowdata *vm_window,
+		void *untrusted_payload)
+{
+	XID window = vm_window->remote_winid;
+	struct genlist *l;
+	struct msg_create *untrusted_crt = untrusted_payload;
+	XID parent;
+
 	/* sanitize start */
-	VERIFY((int) untrusted_crt.width >= 0
-	       && (int) untrusted_crt.height >= 0);
+	VERIFY((int) untrusted_crt->width >= 0
+	       && (int) untrusted_crt->height >= 0);
 	vm_window->width =
-	    min((int) untrusted_crt.width, MAX_WINDOW_WIDTH);
+	    min((int) untrusted_crt->width, MAX_WINDOW_WIDTH);
 	vm_window->height =
-	    min((int) untrusted_crt.height, MAX_WINDOW_HEIGHT);
+	    min((int) untrusted_crt->height, MAX_WINDOW_HEIGHT);
 	/* there is no really good limits for x/y, so pass them to Xorg and hope
 	 * that everything will be ok... */
-	vm_window->x = untrusted_crt.x;
-	vm_window->y = untrusted_crt.y;
-	if (untrusted_crt.override_redirect)
+	vm_window->x = untrusted_crt->x;
+	vm_window->y = untrusted_crt->y;
+	if (untrusted_crt->override_redirect)
 		vm_window->override_redirect = 1;
 	else
 		vm_window->override_redirect = 0;
-	parent = untrusted_crt.parent;
+	parent = untrusted_crt->parent;
 	/* sanitize end */
-	vm_window->remote_winid = window;
 	if (!list_insert(g->remote2local, window, vm_window)) {
 		fprintf(stderr, "list_insert(g->remote2local failed\n");
 		exit(1);
@@ -302,11 +314,20 @@ static void inter_appviewer_lock(Ghandles *g, int mode)
 /* release shared memory connected with given window */
 static void release_mapped_mfns(Ghandles * g, struct windowdata *vm_window)
 {
+	render_fence(g);
 	inter_appviewer_lock(g, 1);
 	g->shmcmd->shmid = vm_window->shminfo.shmid;
 	XShmDetach(g->display, &vm_window->shminfo);
 	XDestroyImage(vm_window->image);
-	XSync(g->display, False);
+	release_backing_pixmap(g, vm_window);
+	/* completions of the detached segment won't be matched */
+	vm_window->puts_pending = 0;
+#ifdef FILL_TRAY_BG
+	release_tray_cache(g, vm_window);
+#endif
+	/* shmoverride unmaps guest memory on detach without reading the
+	 * command, the detach needs not be waited for */
+	XFlush(g->display);
 	inter_appviewer_lock(g, 0);
 	vm_window->image = NULL;
 	if (shmctl(vm_window->shminfo.shmid, IPC_RMID, 0) == -1)
@@ -315,19 +336,24 @@ static void release_mapped_mfns(Ghandles * g, struct windowdata *vm_window)
 
 /* handle VM message: MSG_DESTROY
  * destroy window locally, as requested */
-static void handle_destroy(Ghandles * g, struct genlist *l)
+static void handle_destroy(Ghandles * g, struct windowdata *vm_window,
+		void *UNUSED(untrusted_payload))
 {
-	struct genlist *l2;
-	struct windowdata *vm_window = l->data;
+	struct genlist *l, *l2;
+
+	l = list_lookup(g->remote2local, vm_window->remote_winid);
 	g->windows_count--;
 	if (vm_window == g->last_input_window)
 		g->last_input_window = NULL;
+	/* before the window is destroyed, its background may be reset */
+	if (vm_window->image)
+		release_mapped_mfns(g, vm_window);
+	/* puts from the screen image may still target the window */
+	render_fence(g);
 	XDestroyWindow(g->display, vm_window->local_winid);
 	if (g->log_level > 0)
 		fprintf(stderr, " XDestroyWindow 0x%x\n",
 			(int) vm_window->local_winid);
-	if (vm_window->image)
-		release_mapped_mfns(g, vm_window);
 	l2 = list_lookup(g->wid2windowdata, vm_window->local_winid);
 	list_remove(l);
 	list_remove(l2);
@@ -336,20 +362,28 @@ static void handle_destroy(Ghandles * g, struct genlist *l)
 	free(vm_window);
 }
 
+/* handle VM message: MSG_UNMAP */
+static void handle_unmap(Ghandles * g, struct windowdata *vm_window,
+		void *UNUSED(untrusted_payload))
+{
+	vm_window->is_mapped = 0;
+	(void) XUnmapWindow(g->display, vm_window->local_winid);
+}
+
 /* handle VM message: MSG_MAP
  * Map a window with given parameters */
-static void handle_map(Ghandles * g, struct windowdata *vm_window)
+static void handle_map(Ghandles * g, struct windowdata *vm_window,
+		void *untrusted_payload)
 {
 	struct genlist *trans;
-	struct msg_map_info untrusted_txt;
+	struct msg_map_info *untrusted_txt = untrusted_payload;
 	XSetWindowAttributes attr;
 
-	read_struct(g->xchan, untrusted_txt);
 	vm_window->is_mapped = 1;
-	if (untrusted_txt.transient_for
+	if (untrusted_txt->transient_for
 	    && (trans =
 		list_lookup(g->remote2local,
-			    untrusted_txt.transient_for))) {
+			    untrusted_txt->transient_for))) {
 		struct windowdata *transdata = trans->data;
 		vm_window->transient_for = transdata;
 		XSetTransientForHint(g->display, vm_window->local_winid,
@@ -357,7 +391,7 @@ static void handle_map(Ghandles * g, struct windowdata *vm_window)
 	} else
 		vm_window->transient_for = NULL;
 
-	vm_window->override_redirect = !!(untrusted_txt.override_redirect);
+	vm_window->override_redirect = !!(untrusted_txt->override_redirect);
 	attr.override_redirect = vm_window->override_redirect;
 	XChangeWindowAttributes(g->display, vm_window->local_winid,
 	                        CWOverrideRedirect, &attr);
@@ -370,40 +404,40 @@ static void handle_map(Ghandles * g, struct windowdata *vm_window)
 
 /* handle VM message: MSG_CONFIGURE
  * check if we like new dimensions/position and move relevant window */
-static void handle_configure_from_vm(Ghandles * g, struct windowdata *vm_window)
+static void handle_configure_from_vm(Ghandles * g, struct windowdata *vm_window,
+		void *untrusted_payload)
 {
-	struct msg_configure untrusted_conf;
+	struct msg_configure *untrusted_conf = untrusted_payload;
 	int x, y;
 	unsigned width, height, override_redirect;
 	int conf_changed;
 
-	read_struct(g->xchan, untrusted_conf);
 	if (g->log_level > 1)
 		fprintf(stderr,
 			"handle_configure_from_vm, local 0x%x remote 0x%x, %d/%d, was"
 			" %d/%d, ovr=%d, xy %d/%d, was %d/%d\n",
 			(int) vm_window->local_winid,
 			(int) vm_window->remote_winid,
-			untrusted_conf.width, untrusted_conf.height,
+			untrusted_conf->width, untrusted_conf->height,
 			vm_window->width, vm_window->height,
-			untrusted_conf.override_redirect, untrusted_conf.x,
-			untrusted_conf.y, vm_window->x, vm_window->y);
+			untrusted_conf->override_redirect, untrusted_conf->x,
+			untrusted_conf->y, vm_window->x, vm_window->y);
 	/* sanitize start */
-	if (untrusted_conf.width > MAX_WINDOW_WIDTH)
-		untrusted_conf.width = MAX_WINDOW_WIDTH;
-	if (untrusted_conf.height > MAX_WINDOW_HEIGHT)
-		untrusted_conf.height = MAX_WINDOW_HEIGHT;
-	width = untrusted_conf.width;
-	height = untrusted_conf.height;
+	if (untrusted_conf->width > MAX_WINDOW_WIDTH)
+		untrusted_conf->width = MAX_WINDOW_WIDTH;
+	if (untrusted_conf->height > MAX_WINDOW_HEIGHT)
+		untrusted_conf->height = MAX_WINDOW_HEIGHT;
+	width = untrusted_conf->width;
+	height = untrusted_conf->height;
 	VERIFY(width > 0 && height > 0);
-	if (untrusted_conf.override_redirect > 0)
+	if (untrusted_conf->override_redirect > 0)
 		override_redirect = 1;
 	else
 		override_redirect = 0;
 	/* there is no really good limits for x/y, so pass them to Xorg and hope
 	 * that everything will be ok... */
-	x = untrusted_conf.x;
-	y = untrusted_conf.y;
+	x = untrusted_conf->x;
+	y = untrusted_conf->y;
 	/* sanitize end */
 	if (vm_window->width != width || vm_window->height != height ||
 	    vm_window->x != x || vm_window->y != y)
@@ -556,19 +590,19 @@ static void sanitize_string_from_vm(unsigned char *untrusted_s, int allow_utf8)
 
 /* handle VM message: MSG_VMNAME
  * remove non-printable characters and pass to X server */
-static void handle_wmname(Ghandles * g, struct windowdata *vm_window)
+static void handle_wmname(Ghandles * g, struct windowdata *vm_window,
+		void *untrusted_payload)
 {
 	XTextProperty text_prop;
-	struct msg_wmname untrusted_msg;
-	char buf[sizeof(untrusted_msg.data)];
+	struct msg_wmname *untrusted_msg = untrusted_payload;
+	char buf[sizeof(untrusted_msg->data)];
 	char *list[1] = { buf };
 
-	read_struct(g->xchan, untrusted_msg);
 	/* sanitize start */
-	untrusted_msg.data[sizeof(untrusted_msg.data) - 1] = 0;
-	sanitize_string_from_vm((unsigned char *) (untrusted_msg.data),
+	untrusted_msg->data[sizeof(untrusted_msg->data) - 1] = 0;
+	sanitize_string_from_vm((unsigned char *) (untrusted_msg->data),
 				g->allow_utf8_titles);
-	snprintf(buf, sizeof(buf), "%s", untrusted_msg.data);
+	snprintf(buf, sizeof(buf), "%s", untrusted_msg->data);
 	/* sanitize end */
 	if (g->log_level > 1)
 		fprintf(stderr, "set title for window 0x%x\n",
@@ -582,62 +616,62 @@ static void handle_wmname(Ghandles * g, struct windowdata *vm_window)
 
 /* handle VM message: MSG_WMHINTS
  * Pass hints for window manager to local X server */
-static void handle_wmhints(Ghandles * g, struct windowdata *vm_window)
+static void handle_wmhints(Ghandles * g, struct windowdata *vm_window,
+		void *untrusted_payload)
 {
-	struct msg_window_hints untrusted_msg;
+	struct msg_window_hints *untrusted_msg = untrusted_payload;
 	XSizeHints size_hints;
 
 	memset(&size_hints, 0, sizeof(size_hints));
 
-	read_struct(g->xchan, untrusted_msg);
 
 	/* sanitize start */
 	size_hints.flags = 0;
 	/* check every value and pass it only when sane */
-	if ((untrusted_msg.flags & PMinSize)
-	    && untrusted_msg.min_width <= MAX_WINDOW_WIDTH
-	    && untrusted_msg.min_height <= MAX_WINDOW_HEIGHT) {
+	if ((untrusted_msg->flags & PMinSize)
+	    && untrusted_msg->min_width <= MAX_WINDOW_WIDTH
+	    && untrusted_msg->min_height <= MAX_WINDOW_HEIGHT) {
 		size_hints.flags |= PMinSize;
-		size_hints.min_width = untrusted_msg.min_width;
-		size_hints.min_height = untrusted_msg.min_height;
+		size_hints.min_width = untrusted_msg->min_width;
+		size_hints.min_height = untrusted_msg->min_height;
 	} else
 		fprintf(stderr, "invalid PMinSize for 0x%x (%d/%d)\n",
 			(int) vm_window->local_winid,
-			untrusted_msg.min_width, untrusted_msg.min_height);
-	if ((untrusted_msg.flags & PMaxSize) && untrusted_msg.max_width > 0
-	    && untrusted_msg.max_width <= MAX_WINDOW_WIDTH
-	    && untrusted_msg.max_height > 0
-	    && untrusted_msg.max_height <= MAX_WINDOW_HEIGHT) {
+			untrusted_msg->min_width, untrusted_msg->min_height);
+	if ((untrusted_msg->flags & PMaxSize) && untrusted_msg->max_width > 0
+	    && untrusted_msg->max_width <= MAX_WINDOW_WIDTH
+	    && untrusted_msg->max_height > 0
+	    && untrusted_msg->max_height <= MAX_WINDOW_HEIGHT) {
 		size_hints.flags |= PMaxSize;
-		size_hints.max_width = untrusted_msg.max_width;
-		size_hints.max_height = untrusted_msg.max_height;
+		size_hints.max_width = untrusted_msg->max_width;
+		size_hints.max_height = untrusted_msg->max_height;
 	} else
 		fprintf(stderr, "invalid PMaxSize for 0x%x (%d/%d)\n",
 			(int) vm_window->local_winid,
-			untrusted_msg.max_width, untrusted_msg.max_height);
-	if ((untrusted_msg.flags & PResizeInc) && size_hints.width_inc >= 0
+			untrusted_msg->max_width, untrusted_msg->max_height);
+	if ((untrusted_msg->flags & PResizeInc) && size_hints.width_inc >= 0
 	    && size_hints.width_inc < MAX_WINDOW_WIDTH
 	    && size_hints.height_inc >= 0
 	    && size_hints.height_inc < MAX_WINDOW_HEIGHT) {
 		size_hints.flags |= PResizeInc;
-		size_hints.width_inc = untrusted_msg.width_inc;
-		size_hints.height_inc = untrusted_msg.height_inc;
+		size_hints.width_inc = untrusted_msg->width_inc;
+		size_hints.height_inc = untrusted_msg->height_inc;
 	} else
 		fprintf(stderr, "invalid PResizeInc for 0x%x (%d/%d)\n",
 			(int) vm_window->local_winid,
-			untrusted_msg.width_inc, untrusted_msg.height_inc);
-	if ((untrusted_msg.flags & PBaseSize) && size_hints.base_width >= 0
+			untrusted_msg->width_inc, untrusted_msg->height_inc);
+	if ((untrusted_msg->flags & PBaseSize) && size_hints.base_width >= 0
 	    && size_hints.base_width <= MAX_WINDOW_WIDTH
 	    && size_hints.base_height >= 0
 	    && size_hints.base_height <= MAX_WINDOW_HEIGHT) {
 		size_hints.flags |= PBaseSize;
-		size_hints.base_width = untrusted_msg.base_width;
-		size_hints.base_height = untrusted_msg.base_height;
+		size_hints.base_width = untrusted_msg->base_width;
+		size_hints.base_height = untrusted_msg->base_height;
 	} else
 		fprintf(stderr, "invalid PBaseSize for 0x%x (%d/%d)\n",
 			(int) vm_window->local_winid,
-			untrusted_msg.base_width,
-			untrusted_msg.base_height);
+			untrusted_msg->base_width,
+			untrusted_msg->base_height);
 	/* sanitize end */
 
 	if (g->log_level > 1)
@@ -653,17 +687,17 @@ static void handle_wmhints(Ghandles * g, struct windowdata *vm_window)
 
 /* handle VM message: MSG_WINDOW_FLAGS
  * Pass window state flags for window manager to local X server */
-static void handle_wmflags(Ghandles * g, struct windowdata *vm_window)
+static void handle_wmflags(Ghandles * g, struct windowdata *vm_window,
+		void *untrusted_payload)
 {
-	struct msg_window_flags untrusted_msg;
+	struct msg_window_flags *untrusted_msg = untrusted_payload;
 	struct msg_window_flags msg;
 
-	read_struct(g->xchan, untrusted_msg);
 
 	/* sanitize start */
-	VERIFY((untrusted_msg.flags_set & untrusted_msg.flags_unset) == 0);
-	msg.flags_set = untrusted_msg.flags_set & (WINDOW_FLAG_FULLSCREEN | WINDOW_FLAG_DEMANDS_ATTENTION);
-	msg.flags_unset = untrusted_msg.flags_unset & (WINDOW_FLAG_FULLSCREEN | WINDOW_FLAG_DEMANDS_ATTENTION);
+	VERIFY((untrusted_msg->flags_set & untrusted_msg->flags_unset) == 0);
+	msg.flags_set = untrusted_msg->flags_set & (WINDOW_FLAG_FULLSCREEN | WINDOW_FLAG_DEMANDS_ATTENTION);
+	msg.flags_unset = untrusted_msg->flags_unset & (WINDOW_FLAG_FULLSCREEN | WINDOW_FLAG_DEMANDS_ATTENTION);
 	/* sanitize end */
 
 	if (!vm_window->is_mapped) {
@@ -679,8 +713,8 @@ static void handle_wmflags(Ghandles * g, struct windowdata *vm_window)
 				state_list[i++] = g->wm_state_fullscreen;
 			} else {
 				/* if fullscreen not allowed, substitute request with maximize */
-				state_list[i++] = XInternAtom(g->display, "_NET_WM_STATE_MAXIMIZED_VERT", False);
-				state_list[i++] = XInternAtom(g->display, "_NET_WM_STATE_MAXIMIZED_HORZ", False);
+				state_list[i++] = g->wm_state_maximized_vert;
+				state_list[i++] = g->wm_state_maximized_horz;
 			}
 		}
 		if (msg.flags_set & WINDOW_FLAG_DEMANDS_ATTENTION) {
@@ -719,8 +753,8 @@ static void handle_wmflags(Ghandles * g, struct windowdata *vm_window)
 				ev.data.l[1] = g->wm_state_fullscreen;
 				ev.data.l[2] = 0;
 			} else {
-				ev.data.l[1] = XInternAtom(g->display, "_NET_WM_STATE_MAXIMIZED_VERT", False);
-				ev.data.l[2] = XInternAtom(g->display, "_NET_WM_STATE_MAXIMIZED_HORZ", False);
+				ev.data.l[1] = g->wm_state_maximized_vert;
+				ev.data.l[2] = g->wm_state_maximized_horz;
 			}
 			XSendEvent(g->display, g->root_win, False,
 					(SubstructureNotifyMask|SubstructureRedirectMask),
@@ -740,12 +774,14 @@ static void handle_wmflags(Ghandles * g, struct windowdata *vm_window)
 /* handle VM message: MSG_DOCK
  * Try to dock window in the tray
  * Rest of XEMBED protocol is catched in VM */
-static void handle_dock(Ghandles * g, struct windowdata *vm_window)
+static void handle_dock(Ghandles * g, struct windowdata *vm_window,
+		void *UNUSED(untrusted_payload))
 {
 	Window tray;
 	if (g->log_level > 0)
 		fprintf(stderr, "docking window 0x%x\n",
 			(int) vm_window->local_winid);
+	count_round_trip();
 	tray = XGetSelectionOwner(g->display, g->tray_selection);
 	if (tray != None) {
 		long data[2];
@@ -774,45 +810,68 @@ static void handle_dock(Ghandles * g, struct windowdata *vm_window)
 }
 
 /* handle VM message: MSG_SHMIMAGE
- * pass message data to do_shm_update - there input validation will be done */
-static void handle_shmimage(Ghandles * g, struct windowdata *vm_window)
+ * pass message data to do_shm_update (on next frame tick) - there input
+ * validation will be done */
+static void handle_shmimage(Ghandles * g, struct windowdata *vm_window,
+		void *untrusted_payload)
 {
-	struct msg_shmimage untrusted_mx;
+	struct msg_shmimage *untrusted_mx = untrusted_payload;
 
-	read_struct(g->xchan, untrusted_mx);
 	if (!vm_window->is_mapped)
 		return;
 
 	DBG1("shmimage for 0x%x(remote 0x%x), x: %d, y: %d, w: %d, h: %d\n",
 		(int)vm_window->local_winid, (int) vm_window->remote_winid,
-		untrusted_mx.x, untrusted_mx.y, untrusted_mx.width,
-		untrusted_mx.height);
+		untrusted_mx->x, untrusted_mx->y, untrusted_mx->width,
+		untrusted_mx->height);
 
 	/* WARNING: passing raw values, input validation is done inside of
 	 * do_shm_update */
-	do_shm_update(g, vm_window, untrusted_mx.x, untrusted_mx.y,
-		untrusted_mx.width, untrusted_mx.height);
+	schedule_shm_update_rects(g, vm_window, untrusted_mx, 1);
+}
+
+/* handle VM message: MSG_SHMIMAGE_BATCH
+ * same as MSG_SHMIMAGE for several rectangles of one window at once */
+static void handle_shmimage_batch(Ghandles * g, struct windowdata *vm_window,
+		void *untrusted_payload)
+{
+	struct msg_shmimage_batch *untrusted_batch = untrusted_payload;
+	unsigned count;
+
+	/* sanitize start */
+	VERIFY(untrusted_batch->count > 0
+		&& untrusted_batch->count <= MAX_SHMIMAGE_BATCH);
+	count = untrusted_batch->count;
+	/* sanitize end */
+
+	/* contiguous with the count in the receive buffer */
+	read_view(g->xchan, count * sizeof(untrusted_batch->rects[0]));
+	if (!vm_window->is_mapped)
+		return;
+
+	DBG1("shmimage batch for 0x%x(remote 0x%x), %u rects\n",
+		(int)vm_window->local_winid, (int) vm_window->remote_winid,
+		count);
+
+	/* WARNING: passing raw values, input validation is done inside of
+	 * do_shm_update_rects */
+	schedule_shm_update_rects(g, vm_window, untrusted_batch->rects, count);
 }
 
 /* handle VM message: MSG_MFNDUMP
  * Retrieve memory addresses connected with composition buffer of remote window
  */
-static void handle_mfndump(Ghandles * g, struct windowdata *vm_window)
+static void handle_mfndump(Ghandles * g, struct windowdata *vm_window,
+		void *untrusted_payload)
 {
-	char untrusted_shmcmd_data_from_remote[4096 * SHM_CMD_NUM_PAGES];
-	struct shm_cmd *untrusted_shmcmd;
+	struct shm_cmd *untrusted_shmcmd = untrusted_payload;
 	size_t cmd_size, mfns_size, size;
 	static char dummybuf[100];
 	unsigned num_mfn, off;
 
-	untrusted_shmcmd = (struct shm_cmd *)untrusted_shmcmd_data_from_remote;
-
 	if (vm_window->image)
 		release_mapped_mfns(g, vm_window);
 
-	read_data(g->xchan, untrusted_shmcmd_data_from_remote,
-		sizeof(struct shm_cmd));
-
 	DBG1("MSG_MFNDUMP for 0x%x(0x%x): %dx%d, num_mfn 0x%x off 0x%x\n",
 		(int)vm_window->local_winid, (int) vm_window->remote_winid,
 		untrusted_shmcmd->width, untrusted_shmcmd->height,
@@ -834,7 +893,8 @@ static void handle_mfndump(Ghandles * g, struct windowdata *vm_window)
 	vm_window->image_height = untrusted_shmcmd->height;/* sanitized above */
 
 	mfns_size = SIZEOF_SHARED_MFN * num_mfn;
-	read_data(g->xchan, (char *)untrusted_shmcmd->mfns, mfns_size);
+	/* contiguous with the command in the receive buffer */
+	read_view(g->xchan, mfns_size);
 	vm_window->image = XShmCreateImage(g->display,
 					DefaultVisual(g->display, g->screen), 24,
 					ZPixmap, NULL, &vm_window->shminfo,
@@ -867,9 +927,10 @@ static void handle_mfndump(Ghandles * g, struct windowdata *vm_window)
 	untrusted_shmcmd->shmid = vm_window->shminfo.shmid;
 	untrusted_shmcmd->capsule_id = g->capsule_id;
 
+	/* validated command is copied once, to the memory shared with Xorg */
 	inter_appviewer_lock(g, 1);
 	cmd_size = sizeof(struct shm_cmd) + mfns_size;
-	memcpy(g->shmcmd, untrusted_shmcmd_data_from_remote, cmd_size);
+	memcpy(g->shmcmd, untrusted_shmcmd, cmd_size);
 	size = 4096 * SHM_CMD_NUM_PAGES;
 	if (cmd_size < size) {
 		size -= mfns_size + sizeof(struct shm_cmd);
@@ -879,27 +940,100 @@ static void handle_mfndump(Ghandles * g, struct windowdata *vm_window)
 	vm_window->shminfo.shmaddr = dummybuf;
 	vm_window->image->data = dummybuf;
 	vm_window->shminfo.readOnly = True;
-	XSync(g->display, False);
-	if (!XShmAttach(g->display, &vm_window->shminfo)) {
+	/* shmoverride reads the command while the X server handles the
+	 * attach: it is restored once the attach is done, the only round trip
+	 * of the message */
+	if (shm_attach_checked(g, &vm_window->shminfo) != 0) {
 		fprintf(stderr,
 			"XShmAttach failed for window 0x%x(remote 0x%x)\n",
 			(int) vm_window->local_winid,
 			(int) vm_window->remote_winid);
 	}
-	XSync(g->display, False);
 	g->shmcmd->shmid = g->cmd_shmid;
 	inter_appviewer_lock(g, 0);
 }
 
+/* send the protocol features of the daemon; the agent answers with its
+ * own if it knows this message */
+void send_capabilities(Ghandles * g)
+{
+	struct msg_hdr hdr;
+	struct msg_capabilities caps;
+
+	hdr.type = MSG_CAPABILITIES;
+	hdr.window = 0;
+	caps.features = DAEMON_FEATURES;
+	write_message(g->xchan, hdr, caps);
+}
+
+/* handle VM message: MSG_CAPABILITIES
+ * enable the features supported by both sides */
+static void handle_capabilities(Ghandles * g,
+		struct windowdata *UNUSED(vm_window), void *untrusted_payload)
+{
+	struct msg_capabilities *untrusted_caps = untrusted_payload;
+
+	/* sanitize start */
+	g->features = untrusted_caps->features & DAEMON_FEATURES;
+	/* sanitize end */
+	if (g->log_level > 0)
+		fprintf(stderr, "protocol features: 0x%x\n", g->features);
+}
+
+enum window_lookup {
+	WINDOW_EXISTING,	/* addressed to a window created before */
+	WINDOW_NEW,		/* creates the window */
+	WINDOW_NONE,		/* the window field is unused */
+};
+
+/* handlers of VM messages, indexed by type; the fixed part of the payload
+ * (size bytes) is received before the handler is called, which receives
+ * the variable part if any with read_view() */
+static const struct message_handler {
+	void (*handle)(Ghandles * g, struct windowdata *vm_window,
+		       void *untrusted_payload);
+	size_t size;
+	enum window_lookup window;
+} handlers[MSG_MAX] = {
+	[MSG_CREATE] = { handle_create, sizeof(struct msg_create),
+			 WINDOW_NEW },
+	[MSG_DESTROY] = { handle_destroy, 0, WINDOW_EXISTING },
+	[MSG_MAP] = { handle_map, sizeof(struct msg_map_info),
+		      WINDOW_EXISTING },
+	[MSG_UNMAP] = { handle_unmap, 0, WINDOW_EXISTING },
+	[MSG_CONFIGURE] = { handle_configure_from_vm,
+			    sizeof(struct msg_configure), WINDOW_EXISTING },
+	[MSG_MFNDUMP] = { handle_mfndump, sizeof(struct shm_cmd),
+			  WINDOW_EXISTING },
+	[MSG_SHMIMAGE] = { handle_shmimage, sizeof(struct msg_shmimage),
+			   WINDOW_EXISTING },
+	[MSG_SHMIMAGE_BATCH] = { handle_shmimage_batch,
+				 offsetof(struct msg_shmimage_batch, rects),
+				 WINDOW_EXISTING },
+	[MSG_WMNAME] = { handle_wmname, sizeof(struct msg_wmname),
+			 WINDOW_EXISTING },
+	[MSG_DOCK] = { handle_dock, 0, WINDOW_EXISTING },
+	[MSG_WINDOW_HINTS] = { handle_wmhints,
+			       sizeof(struct msg_window_hints),
+			       WINDOW_EXISTING },
+	[MSG_WINDOW_FLAGS] = { handle_wmflags,
+			       sizeof(struct msg_window_flags),
+			       WINDOW_EXISTING },
+	[MSG_CAPABILITIES] = { handle_capabilities,
+			       sizeof(struct msg_capabilities), WINDOW_NONE },
+};
+
+static struct message_stats stats;
+
 /* VM message dispatcher
  * return false if no message is available, true otherwise */
-bool handle_message(Ghandles * g)
+static bool handle_message(Ghandles * g)
 {
+	const struct message_handler *h;
 	struct msg_hdr untrusted_hdr;
 	uint32_t type;
-	XID window = 0;
 	struct genlist *l;
-	struct windowdata *vm_window = NULL;
+	struct windowdata *vm_window;
 	unsigned char *p;
 	size_t n, size;
 	err_t error;
@@ -916,6 +1050,8 @@ bool handle_message(Ghandles * g)
 		return false;
 	}
 
+	release_views();
+
 	while (size != sizeof(untrusted_hdr)) {
 		p = (unsigned char *)&untrusted_hdr + size;
 		error = xchan_recv(g->xchan, p, sizeof(untrusted_hdr)-size, &n);
@@ -933,23 +1069,42 @@ bool handle_message(Ghandles * g)
 
 	/* sanitized msg type */
 	type = untrusted_hdr.type;
+	stats.count[type - MSG_MIN]++;
+	stats.messages++;
 	if (type == MSG_CLIPBOARD_DATA) {
 		/* window field has special meaning here */
 		/* XXX */
 		//handle_clipboard_data(g, untrusted_hdr.window);
+		/* the content must be consumed anyway */
+		if (untrusted_hdr.window > MAX_CLIPBOARD_SIZE) {
+			fprintf(stderr, "clipboard data too large (%u)\n",
+				untrusted_hdr.window);
+			exit(1);
+		}
+		read_view(g->xchan, untrusted_hdr.window);
 		return true;
 	}
 
-	l = list_lookup(g->remote2local, untrusted_hdr.window);
-	if (type == MSG_CREATE) {
+	h = &handlers[type];
+	if (!h->handle) {
+		fprintf(stderr, "got unknown msg type %d\n", type);
+		exit(1);
+	}
+
+	account_round_trips(type);
+	if (h->window == WINDOW_NONE) {
+		vm_window = NULL;
+	} else if (h->window == WINDOW_NEW) {
+		l = list_lookup(g->remote2local, untrusted_hdr.window);
 		if (l) {
 			fprintf(stderr,
 				"CREATE for already existing window id 0x%x?\n",
 				untrusted_hdr.window);
 			exit(1);
 		}
-		window = untrusted_hdr.window;
+		vm_window = new_window(g, untrusted_hdr.window);
 	} else {
+		l = list_lookup(g->remote2local, untrusted_hdr.window);
 		if (!l) {
 			fprintf(stderr,
 				"msg 0x%x without CREATE for 0x%x\n",
@@ -957,52 +1112,27 @@ bool handle_message(Ghandles * g)
 			exit(1);
 		}
 		vm_window = l->data;
-		/* not needed as it is in vm_window struct
-		   window = untrusted_hdr.window;
-		 */
-	}
-
-	switch (type) {
-	case MSG_CREATE:
-		handle_create(g, window);
-		break;
-	case MSG_DESTROY:
-		handle_destroy(g, l);
-		break;
-	case MSG_MAP:
-		handle_map(g, vm_window);
-		break;
-	case MSG_UNMAP:
-		vm_window->is_mapped = 0;
-		(void) XUnmapWindow(g->display, vm_window->local_winid);
-		break;
-	case MSG_CONFIGURE:
-		handle_configure_from_vm(g, vm_window);
-		break;
-	case MSG_MFNDUMP:
-		handle_mfndump(g, vm_window);
-		break;
-	case MSG_SHMIMAGE:
-		handle_shmimage(g, vm_window);
-		break;
-	case MSG_WMNAME:
-		handle_wmname(g, vm_window);
-		break;
-	case MSG_DOCK:
-		handle_dock(g, vm_window);
-		break;
-	case MSG_WINDOW_HINTS:
-		handle_wmhints(g, vm_window);
-		break;
-	case MSG_WINDOW_FLAGS:
-		handle_wmflags(g, vm_window);
-		break;
-	default:
-		fprintf(stderr, "got unknown msg type %d\n", type);
-		exit(1);
 	}
 
+	h->handle(g, vm_window, read_view(g->xchan, h->size));
+	account_round_trips(MSG_MIN);
 	return true;
 }
 
+/* handle the messages already received from the VM, at most max of them
+ * return the number of messages handled */
+unsigned int handle_messages(Ghandles * g, unsigned int max)
+{
+	unsigned int n;
+
+	n = 0;
+	while (n < max && handle_message(g))
+		n++;
+	if (n > 0)
+		stats.wakeups++;
+	if (g->log_level > 1)
+		report_message_stats(&stats);
+	return n;
+}
+
 // vim: noet:ts=8:
@@ -0,0 +1,305 @@
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "gui_common.h"
+#include "guiserver.h"
+#include "server_common.h"
+#include "render.h"
+
+enum render_op {
+	RENDER_PUT,
+	RENDER_SYNC,	/* answered once the X server is done with all puts */
+};
+
+struct render_cmd {
+	enum render_op op;
+	Drawable drawable;
+	XImage *image;
+	int src_x;
+	int src_y;
+	int dst_x;
+	int dst_y;
+	int width;
+	int height;
+	int send_event;
+	unsigned long seq;	/* RENDER_SYNC */
+};
+
+struct render {
+	Display *display;	/* used by the render thread only */
+	GC context;
+	int completion_type;
+	pthread_t thread;
+	/* main thread to render thread */
+	struct render_cmd cmds[RENDER_QUEUE_SIZE];
+	unsigned int cmd_head;	/* written by the main thread */
+	unsigned int cmd_tail;	/* written by the render thread */
+	/* render thread to main thread */
+	ShmSeg completions[RENDER_QUEUE_SIZE];
+	unsigned int done_head;	/* written by the render thread */
+	unsigned int done_tail;	/* written by the main thread */
+	unsigned long synced;	/* last sync answered */
+	/* main thread only */
+	unsigned long seq;	/* last sync queued */
+	unsigned int fenced;	/* cmd_head at last fence */
+	int unflushed;		/* commands queued since the thread was woken */
+	int wake_fd;		/* eventfd: commands queued */
+	int done_fd;		/* eventfd: completions queued or sync answered */
+};
+
+
+static void notify(int fd)
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) != sizeof(one))
+		err(1, "eventfd write");
+}
+
+static void drain(int fd)
+{
+	uint64_t count;
+
+	if (read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+		err(1, "eventfd read");
+}
+
+/* a full ring drops the completion: the window is unblocked after
+ * PENDING_PUTS_TIMEOUT_MS, as if the put had failed */
+static int push_completion(struct render *r, ShmSeg shmseg)
+{
+	unsigned int head = r->done_head;
+
+	if (head - __atomic_load_n(&r->done_tail, __ATOMIC_ACQUIRE) ==
+	    RENDER_QUEUE_SIZE)
+		return 0;
+	r->completions[head & (RENDER_QUEUE_SIZE - 1)] = shmseg;
+	__atomic_store_n(&r->done_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static void run_cmd(struct render *r, const struct render_cmd *cmd)
+{
+	switch (cmd->op) {
+	case RENDER_PUT:
+		XShmPutImage(r->display, cmd->drawable, r->context, cmd->image,
+			cmd->src_x, cmd->src_y, cmd->dst_x, cmd->dst_y,
+			cmd->width, cmd->height, cmd->send_event);
+		break;
+	case RENDER_SYNC:
+		/* guest memory of the puts so far was read by the X server */
+		XSync(r->display, False);
+		__atomic_store_n(&r->synced, cmd->seq, __ATOMIC_RELEASE);
+		break;
+	}
+}
+
+static void *render_thread(void *arg)
+{
+	struct render *r = arg;
+	struct pollfd pollfds[2];
+	struct render_cmd *cmd;
+	unsigned int tail;
+	XEvent event;
+	int notified;
+
+	pollfds[0].fd = r->wake_fd;
+	pollfds[0].events = POLLIN;
+	pollfds[1].fd = ConnectionNumber(r->display);
+	pollfds[1].events = POLLIN;
+
+	while (1) {
+		if (TEMP_FAILURE_RETRY(poll(pollfds, 2, -1)) == -1)
+			err(1, "poll");
+		if (pollfds[0].revents & POLLIN)
+			drain(r->wake_fd);
+
+		notified = 0;
+		tail = r->cmd_tail;
+		while (tail != __atomic_load_n(&r->cmd_head, __ATOMIC_ACQUIRE)) {
+			cmd = &r->cmds[tail & (RENDER_QUEUE_SIZE - 1)];
+			run_cmd(r, cmd);
+			if (cmd->op == RENDER_SYNC)
+				notified = 1;
+			tail++;
+			__atomic_store_n(&r->cmd_tail, tail, __ATOMIC_RELEASE);
+		}
+		XFlush(r->display);
+
+		while (XEventsQueued(r->display, QueuedAfterReading) > 0) {
+			XNextEvent(r->display, &event);
+			if (event.type == r->completion_type &&
+			    push_completion(r,
+				((XShmCompletionEvent *)&event)->shmseg))
+				notified = 1;
+		}
+		if (notified)
+			notify(r->done_fd);
+	}
+
+	return NULL;
+}
+
+static int completions_ready(struct event_source *src)
+{
+	Ghandles *g = src->arg;
+	struct render *r = g->render;
+	unsigned int tail, head;
+
+	drain(r->done_fd);
+	tail = r->done_tail;
+	head = __atomic_load_n(&r->done_head, __ATOMIC_ACQUIRE);
+	for (; tail != head; tail++) {
+		shm_put_completed(g, r->completions[tail &
+				(RENDER_QUEUE_SIZE - 1)]);
+		__atomic_store_n(&r->done_tail, tail + 1, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+/* open the connection of the render thread and start it
+ * the event loop of g must be initialized */
+int render_start(Ghandles * g, const char *display)
+{
+	struct render *r;
+	int error;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		warn("calloc");
+		return -1;
+	}
+
+	r->display = XOpenDisplay(display);
+	if (r->display == NULL) {
+		warnx("render thread failed to connect to display \"%s\"",
+			display);
+		free(r);
+		return -1;
+	}
+	/* images and windows are resources of the main connection, the X
+	 * server lets other connections of the same user use them */
+	r->context = XCreateGC(r->display, DefaultRootWindow(r->display), 0,
+			       NULL);
+	r->completion_type = XShmGetEventBase(r->display) + ShmCompletion;
+
+	r->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	r->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (r->wake_fd == -1 || r->done_fd == -1) {
+		warn("eventfd");
+		return -1;
+	}
+	if (event_add_fd(&g->events, r->done_fd, 0, completions_ready,
+			 g) == NULL)
+		return -1;
+
+	g->render = r;
+	error = pthread_create(&r->thread, NULL, render_thread, r);
+	if (error != 0) {
+		errno = error;
+		warn("pthread_create");
+		g->render = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/* return a free command of the ring, waiting for the render thread to
+ * consume one if needed */
+static struct render_cmd *next_cmd(Ghandles * g)
+{
+	struct render *r = g->render;
+
+	while (r->cmd_head - __atomic_load_n(&r->cmd_tail, __ATOMIC_ACQUIRE) ==
+	       RENDER_QUEUE_SIZE) {
+		render_flush(g);
+		sched_yield();
+	}
+	return &r->cmds[r->cmd_head & (RENDER_QUEUE_SIZE - 1)];
+}
+
+static void queue_cmd(Ghandles * g)
+{
+	struct render *r = g->render;
+
+	__atomic_store_n(&r->cmd_head, r->cmd_head + 1, __ATOMIC_RELEASE);
+	r->unflushed = 1;
+}
+
+/* queue XShmPutImage of image to drawable; like requests to an X
+ * connection, it is sent once render_flush() is called */
+void render_put(Ghandles * g, Drawable drawable, XImage * image,
+		int src_x, int src_y, int dst_x, int dst_y,
+		int width, int height, int send_event)
+{
+	struct render_cmd *cmd;
+
+	cmd = next_cmd(g);
+	cmd->op = RENDER_PUT;
+	cmd->drawable = drawable;
+	cmd->image = image;
+	cmd->src_x = src_x;
+	cmd->src_y = src_y;
+	cmd->dst_x = dst_x;
+	cmd->dst_y = dst_y;
+	cmd->width = width;
+	cmd->height = height;
+	cmd->send_event = send_event;
+	queue_cmd(g);
+}
+
+/* wake the render thread up for the commands queued so far */
+void render_flush(Ghandles * g)
+{
+	struct render *r = g->render;
+
+	if (r == NULL || !r->unflushed)
+		return;
+	r->unflushed = 0;
+	notify(r->wake_fd);
+}
+
+/* wait until the X server is done with every put queued so far: must be
+ * called before an image or its guest memory is released, or a window
+ * destroyed */
+void render_fence(Ghandles * g)
+{
+	struct render *r = g->render;
+	struct render_cmd *cmd;
+	struct pollfd pollfd;
+
+	if (r == NULL || r->cmd_head == r->fenced)
+		return;
+
+	cmd = next_cmd(g);
+	cmd->op = RENDER_SYNC;
+	cmd->seq = ++r->seq;
+	queue_cmd(g);
+	r->fenced = r->cmd_head;
+	render_flush(g);
+
+	pollfd.fd = r->done_fd;
+	pollfd.events = POLLIN;
+	while (__atomic_load_n(&r->synced, __ATOMIC_ACQUIRE) != r->seq) {
+		if (TEMP_FAILURE_RETRY(poll(&pollfd, 1, -1)) == -1)
+			err(1, "poll");
+		drain(r->done_fd);
+	}
+
+	/* completions received meanwhile are left to the main loop, the
+	 * caller is in the middle of releasing a window */
+	if (r->done_tail != __atomic_load_n(&r->done_head, __ATOMIC_ACQUIRE))
+		notify(r->done_fd);
+}
+
+// vim: noet:ts=8:
@@ -0,0 +1,24 @@
+#ifndef _RENDER_H
+#define _RENDER_H 1
+
+/* In threaded mode (-T), window images are put by a render thread with its
+ * own X connection, so that a slow XShmPutImage never holds input
+ * forwarding nor contends on the display lock of the main connection. The
+ * main thread validates updates and queues them to the render thread in a
+ * single producer, single consumer ring; completions come back the same
+ * way. */
+
+/* puts queued to the render thread, and completions queued back; must be a
+ * power of 2 */
+#define RENDER_QUEUE_SIZE	256
+
+int render_start(Ghandles * g, const char *display);
+void render_put(Ghandles * g, Drawable drawable, XImage * image,
+		int src_x, int src_y, int dst_x, int dst_y,
+		int width, int height, int send_event);
+void render_flush(Ghandles * g);
+void render_fence(Ghandles * g);
+
+#endif /* _RENDER_H */
+
+// vim: noet:ts=8:
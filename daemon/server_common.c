@@ -20,15 +20,29 @@
  *
  */
 
+#include <err.h>
+#include <time.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <X11/Xlib.h>
 #include <X11/extensions/XShm.h>
 
 #include "guiserver.h"
 #include "qubes-gui-protocol.h"
 #include "gui_common.h"
+#include "damage.h"
+#include "list.h"
+#include "server_common.h"
+#include "render.h"
+#include "xconn.h"
+#include "tilehash.h"
 
 #define BORDER_WIDTH	2
+/* depth 24 pixels, padding byte returned by XGetImage is ignored */
+#define TRAY_PLANES	0xffffff
 #define min(x, y)	((x) < (y) ? (x) : (y))
 #define max(x, y)	((x) > (y) ? (x) : (y))
 
@@ -49,17 +63,29 @@ void send_configure(struct xchan *xchan, struct windowdata *vm_window,
 	write_message(xchan, hdr, msg);
 }
 
-/* update given fragment of window image
- * can be requested by VM (MSG_SHMIMAGE) and Xserver (XExposeEvent)
- * parameters are not sanitized earlier - we must check it carefully
- * also do not let to cover forced colorful frame (for undecoraded windows)
- */
-void do_shm_update(Ghandles * g, struct windowdata *vm_window,
-		int untrusted_x, int untrusted_y, int untrusted_w,
-		int untrusted_h)
+static int get_border_width(const struct windowdata *vm_window)
+{
+	if (vm_window->is_docked)
+		return 1;
+
+	if (!vm_window->override_redirect) {
+		// Window Manager will take care of the frame...
+		return 0;
+	}
+
+	return BORDER_WIDTH;
+}
+
+/* sanitize a rectangle of window image requested by VM or Xserver and clip
+ * it so that it doesn't cover the forced colorful frame
+ * return 0 if there is nothing left to update */
+static int clip_shm_rect(Ghandles * g, struct windowdata *vm_window,
+		int border_width, int untrusted_x, int untrusted_y,
+		int untrusted_w, int untrusted_h, struct damage_rect *r,
+		int *do_border)
 {
-	int border_width = BORDER_WIDTH;
 	int x = 0, y = 0, w = 0, h = 0;
+	int delta;
 
 	/* sanitize start */
 	if (untrusted_x < 0 || untrusted_y < 0) {
@@ -67,7 +93,7 @@ void do_shm_update(Ghandles * g, struct windowdata *vm_window,
 			(int)vm_window->local_winid,
 			(int)vm_window->remote_winid, untrusted_x,
 			untrusted_y, untrusted_w, untrusted_h);
-		return;
+		return 0;
 	}
 	if (vm_window->image) {
 		x = min(untrusted_x, vm_window->image_width);
@@ -78,7 +104,7 @@ void do_shm_update(Ghandles * g, struct windowdata *vm_window,
 		/* update only onscreen window part */
 		if (vm_window->x >= g->screen_window->image_width ||
 			vm_window->y >= g->screen_window->image_height)
-			return;
+			return 0;
 		if (vm_window->x+untrusted_x < 0)
 			untrusted_x = -vm_window->x;
 		if (vm_window->y+untrusted_y < 0)
@@ -88,170 +114,266 @@ void do_shm_update(Ghandles * g, struct windowdata *vm_window,
 		w = min(max(untrusted_w, 0), g->screen_window->image_width - vm_window->x - x);
 		h = min(max(untrusted_h, 0), g->screen_window->image_height - vm_window->y - y);
 	}
-	/* else: no image to update, will return after possibly drawing a frame */
-
 	/* sanitize end */
 
-	if (!vm_window->override_redirect) {
-		// Window Manager will take care of the frame...
-		border_width = 0;
-	}
-
-	if (vm_window->is_docked) {
-		border_width = 1;
-	}
-
-	int do_border = 0;
-	int delta, i;
-	/* window contains only (forced) frame, so no content to update */
-	if ((int)vm_window->width <= border_width * 2
-		|| (int)vm_window->height <= border_width * 2) {
-		XFillRectangle(g->display, vm_window->local_winid,
-			g->frame_gc, 0, 0,
-			vm_window->width,
-			vm_window->height);
-		return;
-	}
-	if (!vm_window->image && !(g->screen_window && g->screen_window->image))
-		return;
 	/* force frame to be visible: */
 	/*   * left */
 	delta = border_width - x;
 	if (delta > 0) {
 		w -= delta;
 		x = border_width;
-		do_border = 1;
+		*do_border = 1;
 	}
 	/*   * right */
 	delta = x + w - (vm_window->width - border_width);
 	if (delta > 0) {
 		w -= delta;
-		do_border = 1;
+		*do_border = 1;
 	}
 	/*   * top */
 	delta = border_width - y;
 	if (delta > 0) {
 		h -= delta;
 		y = border_width;
-		do_border = 1;
+		*do_border = 1;
 	}
 	/*   * bottom */
 	delta = y + h - (vm_window->height - border_width);
 	if (delta > 0) {
 		h -= delta;
-		do_border = 1;
+		*do_border = 1;
 	}
 
 	/* again check if something left to update */
 	if (w <= 0 || h <= 0)
-		return;
+		return 0;
 
 	DBG1("  do_shm_update for 0x%x(remote 0x%x), after border calc: x=%d, y=%d, w=%d, h=%d\n",
 		(int)vm_window->local_winid,
 		(int)vm_window->remote_winid,
 		x, y, w, h);
 
+	r->x = x;
+	r->y = y;
+	r->width = w;
+	r->height = h;
+	return 1;
+}
+
 #ifdef FILL_TRAY_BG
-	if (vm_window->is_docked) {
-		char *data, *datap;
-		size_t data_sz;
-		int xp, yp;
+/* forget the cached content and mask of a tray icon */
+void release_tray_cache(Ghandles * g, struct windowdata *vm_window)
+{
+	if (vm_window->tray_pixmap != None)
+		XFreePixmap(g->display, vm_window->tray_pixmap);
+	if (vm_window->tray_mask != None)
+		XFreePixmap(g->display, vm_window->tray_mask);
+	free(vm_window->tray_bits);
+	vm_window->tray_pixmap = None;
+	vm_window->tray_mask = None;
+	vm_window->tray_bits = NULL;
+}
+
+/* update the rows [y, y + h) of the mask bits of pixels [x, x + w) from an
+ * image of that area, return 1 if some bit changed */
+static int scan_tray_image(struct windowdata *vm_window, XImage *image,
+		int x, int y, int w, int h)
+{
+	int xp, yp, changed, stride, bytes;
+	unsigned char row[MAX_WINDOW_WIDTH / 8];
+	unsigned char *bits;
 
-		if (!vm_window->image) {
-			/* TODO: implement screen_window handling */
-			return;
+	stride = (vm_window->image_width + 7) / 8;
+	bytes = (w + 7) / 8;
+	changed = 0;
+	for (yp = 0; yp < h; yp++) {
+		if (image->bits_per_pixel == 32) {
+			color_mask(image->data + yp * image->bytes_per_line, w,
+				vm_window->tray_back, TRAY_PLANES, row);
+		} else {
+			memset(row, 0, bytes);
+			for (xp = 0; xp < w; xp++) {
+				if ((XGetPixel(image, xp, yp) & TRAY_PLANES) !=
+						vm_window->tray_back)
+					row[xp / 8] |= 1 << (xp % 8);
+			}
 		}
-		/* allocate image_width _bits_ for each image line */
-		data_sz =
-			(vm_window->image_width / 8 +
-				1) * vm_window->image_height;
-		data = datap = calloc(1, data_sz);
-		if (!data) {
-			perror("malloc(%dx%x -> %zu\n",
-				vm_window->image_width, vm_window->image_height, data_sz);
-			exit(1);
+		bits = vm_window->tray_bits + (y + yp) * stride + x / 8;
+		if (memcmp(bits, row, bytes) != 0) {
+			memcpy(bits, row, bytes);
+			changed = 1;
 		}
+	}
+	return changed;
+}
 
-		/* Create local pixmap, put vmside image to it
-		 * then get local image of the copy.
-		 * This is needed because XGetPixel does not seem to work
-		 * with XShmImage data.
-		 *
-		 * Always use 0,0 w+x,h+y coordinates to generate proper mask. */
-		w = w + x;
-		h = h + y;
-		if (w > vm_window->image_width)
-			w = vm_window->image_width;
-		if (h > vm_window->image_height)
-			h = vm_window->image_height;
-		Pixmap pixmap =
+/* Paint a docked icon over a white background, using the top-left corner
+ * pixel color as transparency color. The icon content is kept in a pixmap
+ * and its transparency mask is cached; only the damaged area is read back
+ * and scanned, and the mask is rebuilt only if some of its bits changed. */
+static void put_tray_image(Ghandles * g, struct windowdata *vm_window,
+		int x, int y, int w, int h)
+{
+	XImage *image;
+	int changed, full, x2;
+	unsigned long back;
+
+	if (!vm_window->image) {
+		/* TODO: implement screen_window handling */
+		return;
+	}
+
+	full = 0;
+	if (vm_window->tray_pixmap == None) {
+		vm_window->tray_bits = calloc(1,
+			(vm_window->image_width + 7) / 8 *
+			vm_window->image_height);
+		if (!vm_window->tray_bits)
+			err(1, "calloc");
+		vm_window->tray_pixmap =
 			XCreatePixmap(g->display, vm_window->local_winid,
 				vm_window->image_width,
 				vm_window->image_height,
 				24);
-		XShmPutImage(g->display, pixmap, g->context,
-			vm_window->image, 0, 0, 0, 0,
-			vm_window->image_width,
-			vm_window->image_height, 0);
-		XImage *image = XGetImage(g->display, pixmap, 0, 0, w, h,
-					0xFFFFFFFF, ZPixmap);
-		/* Use top-left corner pixel color as transparency color */
-		unsigned long back = XGetPixel(image, 0, 0);
-		/* Generate data for transparency mask Bitmap */
-		for (yp = 0; yp < h; yp++) {
-			int step = 0;
-			for (xp = 0; xp < w; xp++) {
-				if (datap - data >= data_sz) {
-					fprintf(stderr,
-						"Impossible internal error\n");
-					exit(1);
-				}
-				if (XGetPixel(image, xp, yp) != back)
-					*datap |= 1 << (step % 8);
-				if (step % 8 == 7)
-					datap++;
-				step++;
-			}
-			/* ensure that new line will start at new byte */
-			if ((step - 1) % 8 != 7)
-				datap++;
+		full = 1;
+	}
+
+	/* scanned area starts and ends on mask bytes boundaries, pixels
+	 * outside of the damage are already in the pixmap */
+	if (full) {
+		x = y = 0;
+		w = vm_window->image_width;
+		h = vm_window->image_height;
+	}
+	XShmPutImage(g->display, vm_window->tray_pixmap, g->context,
+		vm_window->image, x, y, x, y, w, h, 0);
+	x2 = min((x + w + 7) & ~7, vm_window->image_width);
+	x &= ~7;
+	w = x2 - x;
+
+	/* guest memory is only mapped in the X server */
+	count_round_trip();
+	image = XGetImage(g->display, vm_window->tray_pixmap, x, y, w, h,
+			0xFFFFFFFF, ZPixmap);
+	if (!image)
+		return;
+
+	if (x == 0 && y == 0) {
+		back = XGetPixel(image, 0, 0) & TRAY_PLANES;
+		if (back != vm_window->tray_back && !full) {
+			/* transparency color changed, whole mask is stale */
+			XDestroyImage(image);
+			vm_window->tray_back = back;
+			x = y = 0;
+			w = vm_window->image_width;
+			h = vm_window->image_height;
+			count_round_trip();
+			image = XGetImage(g->display, vm_window->tray_pixmap,
+					0, 0, w, h, 0xFFFFFFFF, ZPixmap);
+			if (!image)
+				return;
+			full = 1;
 		}
-		Pixmap mask = XCreateBitmapFromData(g->display,
-						vm_window->local_winid,
-						data, w, h);
-		/* set trayicon background to white color */
+		vm_window->tray_back = back;
+	}
+
+	changed = scan_tray_image(vm_window, image, x, y, w, h);
+	XDestroyImage(image);
+
+	if (changed || vm_window->tray_mask == None) {
+		if (vm_window->tray_mask != None)
+			XFreePixmap(g->display, vm_window->tray_mask);
+		vm_window->tray_mask = XCreateBitmapFromData(g->display,
+			vm_window->local_winid, (char *)vm_window->tray_bits,
+			vm_window->image_width, vm_window->image_height);
+	}
+
+	/* set trayicon background to white color */
+	if (full)
 		XFillRectangle(g->display, vm_window->local_winid,
 			g->tray_gc, 0, 0, vm_window->width,
 			vm_window->height);
-		/* Paint clipped Image */
-		XSetClipMask(g->display, g->context, mask);
-		XPutImage(g->display, vm_window->local_winid,
-			g->context, image, 0, 0, 0, 0, w, h);
-		/* Remove clipping */
-		XSetClipMask(g->display, g->context, None);
-
-		XFreePixmap(g->display, mask);
-		XDestroyImage(image);
-		XFreePixmap(g->display, pixmap);
-		free(data);
-		return;
-	} else
+	else
+		XFillRectangle(g->display, vm_window->local_winid,
+			g->tray_gc, x, y, w, h);
+	/* Paint clipped icon */
+	XSetClipMask(g->display, g->context, vm_window->tray_mask);
+	XCopyArea(g->display, vm_window->tray_pixmap, vm_window->local_winid,
+		g->context, x, y, w, h, x, y);
+	/* Remove clipping */
+	XSetClipMask(g->display, g->context, None);
+}
 #endif
-	{
-		if (vm_window->image) {
-			XShmPutImage(g->display, vm_window->local_winid,
-				g->context, vm_window->image, x,
-				y, x, y, w, h, 0);
-		} else {
-			XShmPutImage(g->display, vm_window->local_winid,
-				g->context, g->screen_window->image, vm_window->x+x,
-				vm_window->y+y, x, y, w, h, 0);
+
+/* create the pixmap holding a copy of window image, filled with the whole
+ * image, or in UPDATE_SHM_PIXMAP mode the pixmap over the guest memory
+ * attached for the image; return 0 if there is no image */
+static int get_backing_pixmap(Ghandles * g, struct windowdata *vm_window)
+{
+	size_t size;
+
+	if (vm_window->backing != None)
+		return 1;
+	if (!vm_window->image || vm_window->image_width == 0 ||
+	    vm_window->image_height == 0)
+		return 0;
+
+	if (g->update_mode == UPDATE_SHM_PIXMAP) {
+		/* image data is at the beginning of the segment, see
+		 * handle_mfndump */
+		vm_window->backing = XShmCreatePixmap(g->display,
+				vm_window->local_winid, vm_window->image->data,
+				&vm_window->shminfo, vm_window->image_width,
+				vm_window->image_height, 24);
+		/* the X server paints exposed areas from the background
+		 * without asking us, which would overwrite the frame */
+		if (get_border_width(vm_window) == 0) {
+			XSetWindowBackgroundPixmap(g->display,
+				vm_window->local_winid, vm_window->backing);
+			vm_window->backing_is_background = 1;
 		}
+		return 1;
 	}
 
-	if (!do_border)
+	vm_window->backing = XCreatePixmap(g->display, vm_window->local_winid,
+			vm_window->image_width, vm_window->image_height, 24);
+	XShmPutImage(g->display, vm_window->backing, g->context,
+		vm_window->image, 0, 0, 0, 0, vm_window->image_width,
+		vm_window->image_height, 0);
+
+	size = (size_t)vm_window->image_width * vm_window->image_height * 4;
+	g->backing_bytes += size;
+	DBG1("backing pixmap for 0x%x: %dx%d, %zu KB, %zu KB total\n",
+		(int)vm_window->local_winid, vm_window->image_width,
+		vm_window->image_height, size / 1024, g->backing_bytes / 1024);
+	return 1;
+}
+
+/* must be called whenever window image is released or resized */
+void release_backing_pixmap(Ghandles * g, struct windowdata *vm_window)
+{
+	if (vm_window->backing == None)
 		return;
 
+	/* the window keeps a reference on its background, which would keep
+	 * guest memory mapped */
+	if (vm_window->backing_is_background) {
+		XSetWindowBackgroundPixmap(g->display, vm_window->local_winid,
+			None);
+		vm_window->backing_is_background = 0;
+	}
+	XFreePixmap(g->display, vm_window->backing);
+	vm_window->backing = None;
+	if (g->update_mode == UPDATE_BACKING_PIXMAP)
+		g->backing_bytes -= (size_t)vm_window->image_width *
+			vm_window->image_height * 4;
+}
+
+static void draw_border(Ghandles * g, struct windowdata *vm_window,
+		int border_width)
+{
+	int i;
+
 	for (i = 0; i < border_width; i++) {
 		XDrawRectangle(g->display, vm_window->local_winid,
 			g->frame_gc, i, i,
@@ -260,4 +382,438 @@ void do_shm_update(Ghandles * g, struct windowdata *vm_window,
 	}
 }
 
+/* window whose image is put when updating given window */
+static struct windowdata *image_owner(Ghandles * g,
+		struct windowdata *vm_window)
+{
+	return vm_window->image ? vm_window : g->screen_window;
+}
+
+/* put image to the drawable, from the render thread if it runs */
+static void put_image(Ghandles * g, Drawable drawable, XImage * image,
+		int src_x, int src_y, int dst_x, int dst_y,
+		int width, int height, int send_event)
+{
+	if (g->render)
+		render_put(g, drawable, image, src_x, src_y, dst_x, dst_y,
+			width, height, send_event);
+	else
+		XShmPutImage(g->display, drawable, g->context, image,
+			src_x, src_y, dst_x, dst_y, width, height,
+			send_event);
+}
+
+/* if send_event is set, a ShmCompletion event is requested for the put and
+ * accounted to the image owner; puts complete in order, so one event per
+ * update is enough */
+static void put_shm_rect(Ghandles * g, struct windowdata *vm_window,
+		const struct damage_rect *r, int send_event)
+{
+	struct windowdata *owner = image_owner(g, vm_window);
+
+	if (vm_window->image &&
+	    g->update_mode == UPDATE_SHM_PIXMAP &&
+	    get_backing_pixmap(g, vm_window)) {
+		/* SHM pixmap content is guest memory already */
+		send_event = 0;
+		XCopyArea(g->display, vm_window->backing,
+			vm_window->local_winid, g->context, r->x, r->y,
+			r->width, r->height, r->x, r->y);
+	} else if (vm_window->image &&
+	    g->update_mode == UPDATE_BACKING_PIXMAP &&
+	    get_backing_pixmap(g, vm_window)) {
+		XShmPutImage(g->display, vm_window->backing,
+			g->context, vm_window->image, r->x,
+			r->y, r->x, r->y, r->width, r->height, send_event);
+		XCopyArea(g->display, vm_window->backing,
+			vm_window->local_winid, g->context, r->x, r->y,
+			r->width, r->height, r->x, r->y);
+	} else if (vm_window->image) {
+		put_image(g, vm_window->local_winid, vm_window->image,
+			r->x, r->y, r->x, r->y, r->width, r->height,
+			send_event);
+	} else {
+		put_image(g, vm_window->local_winid, g->screen_window->image,
+			vm_window->x+r->x, vm_window->y+r->y,
+			r->x, r->y, r->width, r->height, send_event);
+	}
+
+	if (send_event) {
+		owner->puts_pending++;
+		clock_gettime(CLOCK_MONOTONIC, &owner->puts_since);
+	}
+}
+
+/* without a frame interval, updates merged while backlogged are flushed by
+ * shm_put_completed: the timer only bounds the wait for a lost completion,
+ * rearming it at once would spin until then */
+static void arm_frame_timer(Ghandles * g)
+{
+	if (g->frame_interval_param == 0)
+		event_arm_timer(g->frame_timer, PENDING_PUTS_TIMEOUT_MS);
+	else
+		event_arm_timer(g->frame_timer, g->frame_interval);
+}
+
+static long elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* return 1 if an update should stop and leave the remaining stripes for
+ * later: the X server is given the stripes sent so far, and pending events
+ * (keyboard and pointer first of all) are served before the rest */
+static int upload_should_yield(Ghandles * g, const struct timespec *start)
+{
+	if (elapsed_ms(start) >= g->upload_budget_ms)
+		return 1;
+	return XEventsQueued(g->display, QueuedAfterFlush) > 0;
+}
+
+/* put clipped rectangles by horizontal stripes of about UPLOAD_STRIPE_BYTES,
+ * giving up between stripes once upload_should_yield() says so; what isn't
+ * put is merged back in the dirty region of the window and the frame timer
+ * is armed to finish it right after the pending events
+ * return 0 if the update was not complete */
+static int put_shm_rects(Ghandles * g, struct windowdata *vm_window,
+		const struct damage_rect *rects, int n)
+{
+	struct damage_rect stripe;
+	struct timespec start;
+	int i, j, rows, end, last;
+	size_t since_check;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	since_check = 0;
+	for (i = 0; i < n; i++) {
+		rows = max(UPLOAD_STRIPE_BYTES / (rects[i].width * 4), 1);
+		end = rects[i].y + rects[i].height;
+		stripe = rects[i];
+		for (; stripe.y < end; stripe.y += stripe.height) {
+			stripe.height = min(rows, end - stripe.y);
+			last = (i == n - 1 && stripe.y + stripe.height == end);
+			/* the check is made before the put, so that the
+			 * completion event is requested on the last put */
+			if (!last && since_check >= UPLOAD_STRIPE_BYTES) {
+				since_check = 0;
+				if (upload_should_yield(g, &start))
+					last = 1;
+			}
+			put_shm_rect(g, vm_window, &stripe, last);
+			since_check += (size_t)stripe.width * stripe.height * 4;
+			if (!last)
+				continue;
+			if (stripe.y + stripe.height == end && i == n - 1)
+				return 1;
+
+			/* yield */
+			damage_add(&vm_window->dirty, stripe.x,
+				stripe.y + stripe.height, stripe.width,
+				end - stripe.y - stripe.height);
+			for (j = i + 1; j < n; j++)
+				damage_add(&vm_window->dirty, rects[j].x,
+					rects[j].y, rects[j].width,
+					rects[j].height);
+			DBG1("update of 0x%x interrupted after %ldms\n",
+				(int)vm_window->local_winid, elapsed_ms(&start));
+			event_arm_timer(g->frame_timer, 0);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* update given fragments of window image
+ * can be requested by VM (MSG_SHMIMAGE, MSG_SHMIMAGE_BATCH) and Xserver
+ * (XExposeEvent)
+ * rectangles are not sanitized earlier - we must check them carefully
+ * all rectangles are clipped first, then put back to back, and the frame is
+ * redrawn at most once
+ */
+void do_shm_update_rects(Ghandles * g, struct windowdata *vm_window,
+		const struct msg_shmimage *untrusted_rects, int count)
+{
+	struct damage_rect rects[MAX_SHMIMAGE_BATCH];
+	int border_width, do_border = 0;
+	int i, n;
+
+	border_width = get_border_width(vm_window);
+
+	/* window contains only (forced) frame, so no content to update */
+	if ((int)vm_window->width <= border_width * 2
+		|| (int)vm_window->height <= border_width * 2) {
+		XFillRectangle(g->display, vm_window->local_winid,
+			g->frame_gc, 0, 0,
+			vm_window->width,
+			vm_window->height);
+		return;
+	}
+	if (!vm_window->image && !(g->screen_window && g->screen_window->image))
+		return;
+
+	n = 0;
+	for (i = 0; i < count && i < MAX_SHMIMAGE_BATCH; i++) {
+		if (clip_shm_rect(g, vm_window, border_width,
+				untrusted_rects[i].x, untrusted_rects[i].y,
+				untrusted_rects[i].width,
+				untrusted_rects[i].height, &rects[n],
+				&do_border))
+			n++;
+	}
+	if (n == 0)
+		return;
+
+#ifdef FILL_TRAY_BG
+	if (vm_window->is_docked) {
+		/* the mask is generated for the whole icon anyway */
+		int x1 = rects[0].x, y1 = rects[0].y;
+		int x2 = rects[0].x + rects[0].width;
+		int y2 = rects[0].y + rects[0].height;
+
+		for (i = 1; i < n; i++) {
+			x1 = min(x1, rects[i].x);
+			y1 = min(y1, rects[i].y);
+			x2 = max(x2, rects[i].x + rects[i].width);
+			y2 = max(y2, rects[i].y + rects[i].height);
+		}
+		put_tray_image(g, vm_window, x1, y1, x2 - x1, y2 - y1);
+		return;
+	}
+#endif
+
+	put_shm_rects(g, vm_window, rects, n);
+
+	if (do_border)
+		draw_border(g, vm_window, border_width);
+}
+
+/* repaint part of a window uncovered on the local X server; with a backing
+ * pixmap the content is copied inside the X server (or was already painted
+ * from the window background), otherwise it is read again from guest memory
+ * on next frame tick */
+void expose_shm_rect(Ghandles * g, struct windowdata *vm_window,
+		int x, int y, int w, int h)
+{
+	struct damage_rect r;
+	int border_width, do_border = 0;
+
+	border_width = get_border_width(vm_window);
+	if (vm_window->backing == None ||
+	    (int)vm_window->width <= border_width * 2 ||
+	    (int)vm_window->height <= border_width * 2) {
+		schedule_shm_update(g, vm_window, x, y, w, h);
+		return;
+	}
+	if (vm_window->backing_is_background)
+		return;
+
+	if (clip_shm_rect(g, vm_window, border_width, x, y, w, h, &r,
+			&do_border))
+		XCopyArea(g->display, vm_window->backing,
+			vm_window->local_winid, g->context, r.x, r.y,
+			r.width, r.height, r.x, r.y);
+	if (do_border)
+		draw_border(g, vm_window, border_width);
+}
+
+/* update given fragment of window image */
+void do_shm_update(Ghandles * g, struct windowdata *vm_window,
+		int untrusted_x, int untrusted_y, int untrusted_w,
+		int untrusted_h)
+{
+	struct msg_shmimage untrusted_rect;
+
+	untrusted_rect.x = untrusted_x;
+	untrusted_rect.y = untrusted_y;
+	untrusted_rect.width = untrusted_w;
+	untrusted_rect.height = untrusted_h;
+	do_shm_update_rects(g, vm_window, &untrusted_rect, 1);
+}
+
+/* windows which can't be seen keep their updates pending until they are
+ * visible again */
+static int window_visible(const struct windowdata *vm_window)
+{
+	return !vm_window->is_obscured && !vm_window->is_hidden;
+}
+
+/* return 1 if the X server still has MAX_PENDING_PUTS updates of the
+ * window image to do, further updates are then merged in the dirty region
+ * instead of being queued */
+static int puts_backlogged(Ghandles * g, struct windowdata *vm_window)
+{
+	struct windowdata *owner = image_owner(g, vm_window);
+
+	if (!owner || owner->puts_pending < MAX_PENDING_PUTS)
+		return 0;
+	if (elapsed_ms(&owner->puts_since) < PENDING_PUTS_TIMEOUT_MS)
+		return 1;
+
+	fprintf(stderr, "no ShmCompletion for window 0x%x for %dms\n",
+		(int)owner->local_winid, PENDING_PUTS_TIMEOUT_MS);
+	owner->puts_pending = 0;
+	return 0;
+}
+
+/* record updates of given fragments of window image, to be done on next
+ * frame tick
+ * can be requested by VM (MSG_SHMIMAGE, MSG_SHMIMAGE_BATCH) and Xserver
+ * (XExposeEvent)
+ * rectangles are only bounded here to keep the region arithmetic safe; they
+ * are sanitized by do_shm_update_rects when the window is flushed */
+void schedule_shm_update_rects(Ghandles * g, struct windowdata *vm_window,
+		const struct msg_shmimage *untrusted_rects, int count)
+{
+	int untrusted_x, untrusted_y, untrusted_w, untrusted_h;
+	int x, y, w, h, i;
+
+	if (g->frame_interval_param == 0 && window_visible(vm_window) &&
+	    !puts_backlogged(g, vm_window)) {
+		do_shm_update_rects(g, vm_window, untrusted_rects, count);
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		untrusted_x = untrusted_rects[i].x;
+		untrusted_y = untrusted_rects[i].y;
+		untrusted_w = untrusted_rects[i].width;
+		untrusted_h = untrusted_rects[i].height;
+		if (untrusted_x < 0 || untrusted_y < 0)
+			continue;
+		x = min(untrusted_x, MAX_WINDOW_WIDTH);
+		y = min(untrusted_y, MAX_WINDOW_HEIGHT);
+		w = min(max(untrusted_w, 0), MAX_WINDOW_WIDTH);
+		h = min(max(untrusted_h, 0), MAX_WINDOW_HEIGHT);
+		damage_add(&vm_window->dirty, x, y, w, h);
+	}
+
+	if (!damage_empty(&vm_window->dirty) && window_visible(vm_window) &&
+	    !g->frame_timer->armed)
+		arm_frame_timer(g);
+}
+
+void schedule_shm_update(Ghandles * g, struct windowdata *vm_window,
+		int untrusted_x, int untrusted_y, int untrusted_w,
+		int untrusted_h)
+{
+	struct msg_shmimage untrusted_rect;
+
+	untrusted_rect.x = untrusted_x;
+	untrusted_rect.y = untrusted_y;
+	untrusted_rect.width = untrusted_w;
+	untrusted_rect.height = untrusted_h;
+	schedule_shm_update_rects(g, vm_window, &untrusted_rect, 1);
+}
+
+static void flush_window(Ghandles * g, struct windowdata *vm_window)
+{
+	struct msg_shmimage rects[MAX_DAMAGE_RECTS];
+	int i, count;
+
+	count = vm_window->dirty.count;
+	for (i = 0; i < count; i++) {
+		rects[i].x = vm_window->dirty.rects[i].x;
+		rects[i].y = vm_window->dirty.rects[i].y;
+		rects[i].width = vm_window->dirty.rects[i].width;
+		rects[i].height = vm_window->dirty.rects[i].height;
+	}
+	/* an interrupted update puts its remainder back in the region */
+	damage_init(&vm_window->dirty);
+	do_shm_update_rects(g, vm_window, rects, count);
+}
+
+/* frame timer expired: update every dirty window at once
+ * the interval is doubled while flushing takes more than half of it, and
+ * goes back to the configured value once the load drops */
+void frame_tick(Ghandles * g)
+{
+	struct windowdata *vm_window;
+	struct timespec start;
+	struct genlist *l;
+	long duration;
+	int hidden = 0, backlogged = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (l = g->wid2windowdata->next; l != g->wid2windowdata; l = l->next) {
+		vm_window = l->data;
+		if (damage_empty(&vm_window->dirty))
+			continue;
+		if (!window_visible(vm_window))
+			hidden++;
+		else if (puts_backlogged(g, vm_window))
+			backlogged++;
+		else
+			flush_window(g, vm_window);
+	}
+	XFlush(g->display);
+	duration = elapsed_ms(&start);
+
+	if (duration * 2 > g->frame_interval)
+		g->frame_interval = min(g->frame_interval * 2,
+					MAX_FRAME_INTERVAL_MS);
+	else if (duration * 8 < g->frame_interval)
+		g->frame_interval = max(g->frame_interval / 2,
+					g->frame_interval_param);
+	DBG1("frame tick took %ldms, next interval %dms, %d hidden and %d"
+		" backlogged windows pending\n", duration, g->frame_interval,
+		hidden, backlogged);
+
+	/* backlogged windows are retried on next tick, which also bounds
+	 * the wait if a completion is lost */
+	if (backlogged && !g->frame_timer->armed)
+		arm_frame_timer(g);
+}
+
+/* handle ShmCompletion event: the X server is done with an update */
+void shm_put_completed(Ghandles * g, ShmSeg shmseg)
+{
+	struct windowdata *vm_window;
+	struct genlist *l;
+
+	for (l = g->wid2windowdata->next; l != g->wid2windowdata; l = l->next) {
+		vm_window = l->data;
+		if (vm_window->image && vm_window->shminfo.shmseg == shmseg &&
+		    vm_window->puts_pending > 0) {
+			vm_window->puts_pending--;
+			clock_gettime(CLOCK_MONOTONIC, &vm_window->puts_since);
+			break;
+		}
+	}
+	if (l == g->wid2windowdata || g->frame_interval_param != 0)
+		return;
+
+	/* no frame timer: flush updates merged while backlogged */
+	for (l = g->wid2windowdata->next; l != g->wid2windowdata; l = l->next) {
+		vm_window = l->data;
+		if (!damage_empty(&vm_window->dirty) &&
+		    window_visible(vm_window) && !puts_backlogged(g, vm_window))
+			flush_window(g, vm_window);
+	}
+}
+
+/* track whether a window can be seen on the local X server; once it can be
+ * seen again, updates received in the meantime are put at once, before the
+ * following expose events are served */
+void set_window_visibility(Ghandles * g, struct windowdata *vm_window,
+		int obscured, int hidden)
+{
+	int was_visible;
+
+	was_visible = window_visible(vm_window);
+	vm_window->is_obscured = obscured;
+	vm_window->is_hidden = hidden;
+	if (was_visible || !window_visible(vm_window) ||
+	    damage_empty(&vm_window->dirty))
+		return;
+
+	DBG1("window 0x%x visible again, catching up\n",
+		(int)vm_window->local_winid);
+	flush_window(g, vm_window);
+	XFlush(g->display);
+}
+
 // vim: noet:ts=8:
@@ -6,6 +6,23 @@ void send_configure(struct xchan *xchan, struct windowdata *vm_window,
 void do_shm_update(Ghandles * g, struct windowdata *vm_window,
 		int untrusted_x, int untrusted_y, int untrusted_w,
 		int untrusted_h);
+void do_shm_update_rects(Ghandles * g, struct windowdata *vm_window,
+		const struct msg_shmimage *untrusted_rects, int count);
+void schedule_shm_update_rects(Ghandles * g, struct windowdata *vm_window,
+		const struct msg_shmimage *untrusted_rects, int count);
+void schedule_shm_update(Ghandles * g, struct windowdata *vm_window,
+		int untrusted_x, int untrusted_y, int untrusted_w,
+		int untrusted_h);
+void frame_tick(Ghandles * g);
+void expose_shm_rect(Ghandles * g, struct windowdata *vm_window,
+		int x, int y, int w, int h);
+void release_backing_pixmap(Ghandles * g, struct windowdata *vm_window);
+void shm_put_completed(Ghandles * g, ShmSeg shmseg);
+void set_window_visibility(Ghandles * g, struct windowdata *vm_window,
+		int obscured, int hidden);
+#ifdef FILL_TRAY_BG
+void release_tray_cache(Ghandles * g, struct windowdata *vm_window);
+#endif
 
 #endif /* _COMMON_H */
 
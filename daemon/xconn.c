@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#include <xcb/shm.h>
+
+#include "gui_common.h"
+#include "guiserver.h"
+#include "xconn.h"
+
+#define ROUND_TRIPS_INTERVAL_MS	10000
+
+/* blocking round trips by message type, MSG_MIN standing for X events and
+ * timers */
+static struct {
+	unsigned long count[MSG_MAX - MSG_MIN];
+	uint32_t type;
+	struct timespec since;
+} round_trips;
+
+
+void xconn_init(Ghandles * g)
+{
+	g->xcb = XGetXCBConnection(g->display);
+	round_trips.type = MSG_MIN;
+}
+
+/* intern every atom with one round trip */
+void intern_atoms(Ghandles * g, const struct atom_name *atoms, int count)
+{
+	xcb_intern_atom_cookie_t cookies[count];
+	xcb_intern_atom_reply_t *reply;
+	int i;
+
+	for (i = 0; i < count; i++)
+		cookies[i] = xcb_intern_atom(g->xcb, 0, strlen(atoms[i].name),
+					     atoms[i].name);
+	count_round_trip();
+	for (i = 0; i < count; i++) {
+		reply = xcb_intern_atom_reply(g->xcb, cookies[i], NULL);
+		*atoms[i].atom = reply ? reply->atom : None;
+		free(reply);
+	}
+}
+
+/* attach the segment of shminfo to the X server, and wait until it is
+ * done: one round trip, which also reports a failure
+ * return -1 on error */
+int shm_attach_checked(Ghandles * g, XShmSegmentInfo * shminfo)
+{
+	xcb_void_cookie_t cookie;
+	xcb_generic_error_t *error;
+
+	shminfo->shmseg = xcb_generate_id(g->xcb);
+	cookie = xcb_shm_attach_checked(g->xcb, shminfo->shmseg,
+					shminfo->shmid, shminfo->readOnly);
+	count_round_trip();
+	error = xcb_request_check(g->xcb, cookie);
+	if (error != NULL) {
+		fprintf(stderr, "ShmAttach failed: error %d\n",
+			error->error_code);
+		free(error);
+		return -1;
+	}
+	return 0;
+}
+
+/* XGetWindowAttributes() also queries the geometry, that's two round trips
+ * where one is needed
+ * return -1 if the window is gone */
+int get_window_map_state(Ghandles * g, Window window, int *map_state,
+			 int *override_redirect)
+{
+	xcb_get_window_attributes_cookie_t cookie;
+	xcb_get_window_attributes_reply_t *reply;
+
+	cookie = xcb_get_window_attributes(g->xcb, window);
+	count_round_trip();
+	reply = xcb_get_window_attributes_reply(g->xcb, cookie, NULL);
+	if (reply == NULL)
+		return -1;
+	*map_state = reply->map_state;
+	*override_redirect = reply->override_redirect;
+	free(reply);
+	return 0;
+}
+
+/* a blocking round trip is about to be made, either here or with Xlib */
+void count_round_trip(void)
+{
+	round_trips.count[round_trips.type - MSG_MIN]++;
+}
+
+/* count the following round trips against given message type, or MSG_MIN
+ * for X events and timers */
+void account_round_trips(uint32_t type)
+{
+	round_trips.type = type;
+}
+
+/* log blocking round trips per second, by message type, every
+ * ROUND_TRIPS_INTERVAL_MS */
+void report_round_trips(void)
+{
+	struct timespec now;
+	long elapsed;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (round_trips.since.tv_sec == 0 && round_trips.since.tv_nsec == 0) {
+		round_trips.since = now;
+		return;
+	}
+	elapsed = (now.tv_sec - round_trips.since.tv_sec) * 1000 +
+		(now.tv_nsec - round_trips.since.tv_nsec) / 1000000;
+	if (elapsed < ROUND_TRIPS_INTERVAL_MS)
+		return;
+
+	fprintf(stderr, "X round trips:\n");
+	for (i = 0; i < MSG_MAX - MSG_MIN; i++) {
+		if (round_trips.count[i])
+			fprintf(stderr, "    %-20s %lu/s\n",
+				i ? message_name(MSG_MIN + i) : "X events",
+				round_trips.count[i] * 1000 / elapsed);
+	}
+	memset(round_trips.count, 0, sizeof(round_trips.count));
+	round_trips.since = now;
+}
+
+// vim: noet:ts=8:
@@ -0,0 +1,26 @@
+#ifndef _XCONN_H
+#define _XCONN_H 1
+
+/* Requests whose reply the daemon waits for. They are sent through XCB on
+ * the connection shared with Xlib, and replies are fetched from their
+ * cookies only once needed, so that independent requests share one round
+ * trip. Every blocking round trip is counted against the message being
+ * handled, see report_round_trips(). */
+
+struct atom_name {
+	Atom *atom;
+	const char *name;
+};
+
+void xconn_init(Ghandles * g);
+void intern_atoms(Ghandles * g, const struct atom_name *atoms, int count);
+int shm_attach_checked(Ghandles * g, XShmSegmentInfo * shminfo);
+int get_window_map_state(Ghandles * g, Window window, int *map_state,
+			 int *override_redirect);
+void count_round_trip(void);
+void account_round_trips(uint32_t type);
+void report_round_trips(void);
+
+#endif /* _XCONN_H */
+
+// vim: noet:ts=8:
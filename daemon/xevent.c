@@ -34,6 +34,7 @@
 #include "guiserver.h"
 #include "server_common.h"
 #include "list.h"
+#include "xconn.h"
 
 /* short macro for beginning of each xevent handling function
  * checks if this window is managed by guid and declares windowdata struct
@@ -83,6 +84,8 @@ static int fix_docked_xy(Ghandles * g, struct windowdata *vm_window, const char
 	/* docked window is reparented to root_win on vmside */
 	Window win;
 	int x, y, ret = 0;
+
+	count_round_trip();
 	if (XTranslateCoordinates
 	    (g->display, vm_window->local_winid, g->root_win,
 	     0, 0, &x, &y, &win) == True) {
@@ -207,12 +210,43 @@ static void process_xevent_motion(Ghandles * g, const XMotionEvent * ev)
 {
 	struct msg_hdr hdr;
 	struct msg_motion k;
+	XEvent next;
+	Window root, child;
+	int root_x, root_y, x, y;
+	unsigned int state;
 	CHECK_NONMANAGED_WINDOW(g, ev->window);
 
 	k.x = ev->x;
 	k.y = ev->y;
 	k.state = ev->state;
 	k.is_hint = ev->is_hint;
+
+	/* consecutive motions in the queue are sent as the latest one; any
+	 * other event in between stops it, to keep the order of input */
+	while (XEventsQueued(g->display, QueuedAlready) > 0) {
+		XPeekEvent(g->display, &next);
+		if (next.type != MotionNotify || next.xmotion.window != ev->window
+		    || next.xmotion.state != k.state)
+			break;
+		XNextEvent(g->display, &next);
+		k.x = next.xmotion.x;
+		k.y = next.xmotion.y;
+		k.is_hint = next.xmotion.is_hint;
+	}
+
+	/* with PointerMotionHintMask, the position is queried, which also
+	 * allows the next motion to be reported */
+	if (k.is_hint) {
+		count_round_trip();
+		if (!XQueryPointer(g->display, ev->window, &root, &child,
+				   &root_x, &root_y, &x, &y, &state))
+			return;
+		k.x = x;
+		k.y = y;
+		k.state = state;
+		k.is_hint = 0;
+	}
+
 	hdr.type = MSG_MOTION;
 	hdr.window = vm_window->remote_winid;
 	write_message(g->xchan, hdr, k);
@@ -230,6 +264,7 @@ static void process_xevent_crossing(Ghandles * g, const XCrossingEvent * ev)
 
 	if (ev->type == EnterNotify) {
 		char keys[32];
+		count_round_trip();
 		XQueryKeymap(g->display, keys);
 		hdr.type = MSG_KEYMAP_NOTIFY;
 		hdr.window = 0;
@@ -263,6 +298,7 @@ static void process_xevent_focus(Ghandles * g, const XFocusChangeEvent * ev)
 	CHECK_NONMANAGED_WINDOW(g, ev->window);
 	if (ev->type == FocusIn) {
 		char keys[32];
+		count_round_trip();
 		XQueryKeymap(g->display, keys);
 		hdr.type = MSG_KEYMAP_NOTIFY;
 		hdr.window = 0;
@@ -282,19 +318,21 @@ static void process_xevent_focus(Ghandles * g, const XFocusChangeEvent * ev)
 static void process_xevent_expose(Ghandles * g, const XExposeEvent * ev)
 {
 	CHECK_NONMANAGED_WINDOW(g, ev->window);
-	do_shm_update(g, vm_window, ev->x, ev->y, ev->width, ev->height);
+	expose_shm_rect(g, vm_window, ev->x, ev->y, ev->width, ev->height);
 }
 
 /* handle local Xserver event: XMapEvent
  * after some checks, send to relevant window in VM */
 static void process_xevent_mapnotify(Ghandles * g, const XMapEvent * ev)
 {
-	XWindowAttributes attr;
+	int map_state, override_redirect;
 	CHECK_NONMANAGED_WINDOW(g, ev->window);
 	if (vm_window->is_mapped)
 		return;
-	XGetWindowAttributes(g->display, vm_window->local_winid, &attr);
-	if (attr.map_state != IsViewable && !vm_window->is_docked) {
+	if (get_window_map_state(g, vm_window->local_winid, &map_state,
+				 &override_redirect) != 0)
+		return;
+	if (map_state != IsViewable && !vm_window->is_docked) {
 		/* Unmap windows that are not visible on vmside.
 		 * WM may try to map non-viewable windows ie. when
 		 * switching desktops.
@@ -307,7 +345,7 @@ static void process_xevent_mapnotify(Ghandles * g, const XMapEvent * ev)
 		/* Tray windows shall be visible always */
 		struct msg_hdr hdr;
 		struct msg_map_info map_info;
-		map_info.override_redirect = attr.override_redirect;
+		map_info.override_redirect = override_redirect;
 		hdr.type = MSG_MAP;
 		hdr.window = vm_window->remote_winid;
 		write_message(g->xchan, hdr, map_info);
@@ -327,7 +365,7 @@ static void process_xevent_propertynotify(Ghandles *g, const XPropertyEvent * ev
 	Atom act_type;
 	Atom *state_list;
 	unsigned long nitems, bytesleft, i;
-	int ret, act_fmt;
+	int ret, act_fmt, hidden;
 	uint32_t flags;
 	struct msg_hdr hdr;
 	struct msg_window_flags msg;
@@ -337,11 +375,13 @@ static void process_xevent_propertynotify(Ghandles *g, const XPropertyEvent * ev
 		if (!vm_window->is_mapped)
 			return;
 		if (ev->state == PropertyNewValue) {
+			count_round_trip();
 			ret = XGetWindowProperty(g->display, vm_window->local_winid, g->wm_state, 0, 10,
 					False, XA_ATOM, &act_type, &act_fmt, &nitems, &bytesleft, (unsigned char**)&state_list);
 			if (ret == Success && bytesleft > 0) {
 			  /* Ensure we read all of the atoms */
 			  XFree(state_list);
+			  count_round_trip();
 			  ret = XGetWindowProperty(g->display, vm_window->local_winid, g->wm_state,
 			        0, (10 * 4 + bytesleft + 3) / 4, False, XA_ATOM, &act_type, &act_fmt,
 			        &nitems, &bytesleft, (unsigned char**)&state_list);
@@ -353,13 +393,20 @@ static void process_xevent_propertynotify(Ghandles *g, const XPropertyEvent * ev
 				}
 			}
 			flags = 0;
+			hidden = 0;
 			for (i = 0; i < nitems; i++) {
 				flags |= flags_from_atom(g, state_list[i]);
+				if (state_list[i] == g->wm_state_hidden)
+					hidden = 1;
 			}
 			XFree(state_list);
 		} else { /* PropertyDelete */
 			flags = 0;
+			hidden = 0;
 		}
+		if (hidden != vm_window->is_hidden)
+			set_window_visibility(g, vm_window,
+				vm_window->is_obscured, hidden);
 		if (flags == vm_window->flags_set) {
 			/* no change */
 			return;
@@ -373,6 +420,24 @@ static void process_xevent_propertynotify(Ghandles *g, const XPropertyEvent * ev
 	}
 }
 
+/* handle local Xserver event: XVisibilityEvent
+ * updates of fully obscured windows are deferred */
+static void process_xevent_visibility(Ghandles * g, const XVisibilityEvent * ev)
+{
+	CHECK_NONMANAGED_WINDOW(g, ev->window);
+	set_window_visibility(g, vm_window,
+		ev->state == VisibilityFullyObscured, vm_window->is_hidden);
+}
+
+/* handle local Xserver event: XUnmapEvent
+ * no visibility event is sent when a window becomes unviewable, one is sent
+ * again when it is mapped */
+static void process_xevent_unmapnotify(Ghandles * g, const XUnmapEvent * ev)
+{
+	CHECK_NONMANAGED_WINDOW(g, ev->window);
+	set_window_visibility(g, vm_window, 1, vm_window->is_hidden);
+}
+
 /* handle local Xserver event: _XEMBED
  * if window isn't mapped already - map it now */
 static void process_xevent_xembed(Ghandles * g, const XClientMessageEvent * ev)
@@ -446,6 +511,12 @@ void process_xevent(Ghandles * g)
 	case MapNotify:
 		process_xevent_mapnotify(g, (XMapEvent *) & event_buffer);
 		break;
+	case UnmapNotify:
+		process_xevent_unmapnotify(g, (XUnmapEvent *) & event_buffer);
+		break;
+	case VisibilityNotify:
+		process_xevent_visibility(g, (XVisibilityEvent *) & event_buffer);
+		break;
 	case PropertyNotify:
 		process_xevent_propertynotify(g, (XPropertyEvent *) & event_buffer);
 		break;
@@ -465,7 +536,10 @@ void process_xevent(Ghandles * g)
 					     event_buffer.xclient.window);
 		}
 		break;
-	default:;
+	default:
+		if (event_buffer.type == g->shm_completion_type)
+			shm_put_completed(g,
+				((XShmCompletionEvent *) &event_buffer)->shmseg);
 	}
 }
 